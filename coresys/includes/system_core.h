@@ -26,12 +26,12 @@
 void setup_systick(uint32_t systick_interrupt_period);
 
 /**
- * @brief Safely retrieve the current tick count
+ * @brief Retrieve the current tick count
  *
- * @return uint32_t Current value of tick_count with interrupt protection
+ * @return uint32_t Current value of tick_count
  *
- * This function provides thread-safe access to the tick counter by
- * temporarily disabling interrupts during the read operation.
+ * A 32-bit aligned load is atomic on the Cortex-M4, so no interrupt needs to
+ * be masked to read the counter.
  */
 uint32_t get_tick_count(void);
 
@@ -40,8 +40,9 @@ uint32_t get_tick_count(void);
  *
  * Increments the global tick counter on each SysTick interrupt.
  *
- * Note: This function doesn't require interrupt protection as it's the only
- * function modifying tick_count besides main(), which handles its own protection.
+ * Note: SysTick runs at the kernel ceiling priority (see neo_critical.h), so no handler that
+ * touches tick_count or the kernel can preempt it and nothing needs to be masked here; the
+ * kernel holds SysTick off with BASEPRI whenever it updates tick_count itself.
  */
 void SysTick_handler(void);
 
@@ -9,8 +9,9 @@
 /*
 
 The CPU is in the privileged state after the reset and the reset handler executes in the
-privileged state; since I don't change the CPU state anytime later (for now atleast), the CPU is executing in
-the privileged state all the time
+privileged state; main and the kernel initialization stay privileged, but once the scheduler runs, user threads
+execute unprivileged (CONTROL.nPRIV is set per thread on every context switch) and enter the kernel through
+SVCall_handler, which neoRTOS overrides
 
 */
 void reset_handler(void);
@@ -19,12 +20,14 @@ void enable_fpu(void);
 void system_reset(void);
 
 extern uint32_t _etext, _sdata, _edata, __bss_start__, __bss_end__, _sidata;
+extern uint32_t _skernel_data, _ekernel_data, _sikernel_data, _skernel_bss, _ekernel_bss;
 extern int main(void);
 
 #define VECTOR_TABLE_LEN 84
 
-/* We have not enabled the hardware Floating Point Unit in this startup file; so in the make file,
-software floating point should be used while compiling/linking */
+/* The hardware Floating Point Unit is enabled first thing in the reset handler, before any compiled code
+can use a floating-point register; automatic and lazy state preservation are turned on so that only exceptions
+interrupting code that actually used the FPU pay for stacking s0-s15 */
 
 /* When FPU enabled: -mfloat-abi=hard -mfpu=fpv4-sp-d16 */
 /* ARM FPU is fpv4 with single precision floating point support */
@@ -193,10 +196,20 @@ __attribute__((used)) void enable_fpu(void)
 {
     // set CP10 and CP11 to full access in CPACR
     SCB->CPACR |= (0xF << 20); // enable FPU access
+
+    // ASPEN: set CONTROL.FPCA on the first floating-point instruction, so exception entry knows whether to reserve the extended frame
+    // LSPEN: reserve space for s0-s15 and FPSCR on exception entry but only write them if the handler itself uses the FPU
+    FPU->FPCCR |= FPU_FPCCR_ASPEN_Msk | FPU_FPCCR_LSPEN_Msk;
+
+    __DSB();
+    __ISB(); // the FPU must be usable by the very next instruction
 }
 
 __attribute__((used)) void reset_handler(void)
 {
+    // enable the FPU before anything else; code compiled with -mfloat-abi=hard may use floating-point registers anywhere
+    enable_fpu();
+
     /* The C standard dictates that all data sections are initialized with their */
     /* initial values and all bss sections are filled with zeroes before main() is called */
 
@@ -222,8 +235,24 @@ __attribute__((used)) void reset_handler(void)
         *dst_ptr++ = 0;
     }
 
-    /* // enable the FPU
-    enable_fpu(); */
+    // copy the kernel's initialized data to kernel RAM
+    size = (uint32_t)&_ekernel_data - (uint32_t)&_skernel_data;
+    dst_ptr = (uint8_t *)&_skernel_data;
+    src_ptr = (uint8_t *)&_sikernel_data;
+
+    for (uint32_t counter = 0; counter < size; counter++)
+    {
+        *dst_ptr++ = *src_ptr++;
+    }
+
+    // and zero the rest of it, like .bss
+    size = (uint32_t)&_ekernel_bss - (uint32_t)&_skernel_bss;
+    dst_ptr = (uint8_t *)&_skernel_bss;
+
+    for (uint32_t counter = 0; counter < size; counter++)
+    {
+        *dst_ptr++ = 0;
+    }
 
     // since we are not linking the C standard library with the project, there is no
     // need to call the C lib init constructor function __libc_init_array()
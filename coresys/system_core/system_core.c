@@ -28,48 +28,44 @@
 #define SYS_CLOCK 16000000U /* Default system clock frequency (16MHz) */
 
 /* Global tick counter */
-volatile uint32_t tick_count = 0; // global tick counter; each tick measures 1 milisecond passed
+// in kernel RAM (see linker_script.ld), so threads can read it but only the kernel can write it
+__attribute__((section(".kernel_bss"))) volatile uint32_t tick_count = 0; // global tick counter; each tick measures 1 milisecond passed
 
 /**
  * @brief SysTick interrupt handler
  *
  * Increments the global tick counter on each SysTick interrupt.
  *
- * Note: This function doesn't require interrupt protection as it's the only
- * function modifying tick_count besides main(), which handles its own protection.
+ * Note: SysTick runs at the kernel ceiling priority (see neo_critical.h), so no handler that
+ * touches tick_count or the kernel can preempt it and nothing needs to be masked here; the
+ * kernel holds SysTick off with BASEPRI whenever it updates tick_count itself.
  */
 
 __attribute__((naked)) void SysTick_handler(void)
 {
     __asm__ volatile(
         ".global exit_from_interrupt_ \n"
-        "cpsid i \n"             // Disable interrupts
         "ldr r0, =tick_count \n" // Load address of tick_count
         "ldr r1, [r0] \n"        // Load tick_count value
         "add r1, r1, #1 \n"      // Increment tick_count
         "str r1, [r0] \n"        // Store updated value back
         "b thread_handler \n"    // Branch to thread handler
         "exit_from_interrupt_: \n"
-        "cpsie i \n" // Enable interrupts
-        "bx lr \n"   // Return from interrupt
+        "bx lr \n" // Return from interrupt
     );
 }
 
 /**
- * @brief Safely retrieve the current tick count
+ * @brief Retrieve the current tick count
  *
- * @return uint32_t Current value of tick_count with interrupt protection
+ * @return uint32_t Current value of tick_count
  *
- * This function provides thread-safe access to the tick counter by
- * temporarily disabling interrupts during the read operation.
+ * A 32-bit aligned load is atomic on the Cortex-M4, so no interrupt needs to
+ * be masked to read the counter.
  */
 uint32_t get_tick_count(void)
 {
-    uint32_t curr_count;
-    __disable_irq(); /* Disable interrupts for atomic operation */
-    curr_count = tick_count;
-    __enable_irq(); /* Re-enable interrupts */
-    return curr_count;
+    return tick_count;
 }
 
 /**
@@ -6,7 +6,18 @@
 #include <stdlib.h>
 
 void neo_heap_init(void);
-void *neo_alloc(uint16_t size);
+void *neo_alloc(uint32_t size);
 void neo_free(void *ptr);
 
+#ifdef NEO_PROFILE
+#include "neo_profile.h"
+extern neo_profile_stat_t neo_bench_alloc; // cycles spent in each allocation of neo_profile_heap
+extern neo_profile_stat_t neo_bench_free;  // cycles spent in each free of neo_profile_heap
+extern uint32_t neo_bench_alloc_failed;    // allocations in neo_profile_heap that found no free chunk
+extern neo_profile_stat_t neo_bench_first_fit_alloc; // the same for the first-fit allocator neo_alloc replaced,
+extern neo_profile_stat_t neo_bench_first_fit_free;  // run over the same trace by neo_profile_heap
+extern uint32_t neo_bench_first_fit_alloc_failed;
+void neo_profile_heap(void);
+#endif
+
 #endif // NEO_ALLOC_H
\ No newline at end of file
@@ -0,0 +1,117 @@
+#ifndef NEO_BITMAP_H
+#define NEO_BITMAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "core_cm4.h"
+
+/* Two-level bitmap of thread ids
+ *
+ * Thread i is bit (i % 32) of leaf[i / 32]; bit w of summary is set when leaf[w] is non-zero
+ * Finding the highest or lowest member is one CLZ on the summary and one on the leaf, whatever the number of threads
+ * Sized at compile time for MAX_THREADS plus the idle thread; include it through neo_threads.h, which defines MAX_THREADS
+ */
+
+#define NEO_BITMAP_BITS (MAX_THREADS + 1U)
+#define NEO_BITMAP_LEAVES ((NEO_BITMAP_BITS + 31U) / 32U)
+
+_Static_assert(NEO_BITMAP_LEAVES <= 32U, "every leaf needs a bit in the summary word");
+
+typedef struct
+{
+    uint32_t summary;
+    uint32_t leaf[NEO_BITMAP_LEAVES];
+} neo_thread_bitmap_t;
+
+// __CLZ from CMSIS is __builtin_clz, which is undefined for zero; the clz instruction itself returns 32 for zero
+static inline uint32_t neo_count_leading_zeros(uint32_t num)
+{
+    uint32_t result;
+    __asm__ volatile("clz %0, %1" : "=r"(result) : "r"(num));
+    return result;
+}
+
+// returns the bit number of the most significant one in num
+// if there is no one in num (i.e num is zero), it returns -1
+static inline int32_t neo_most_sig_one(uint32_t num)
+{
+    return 31 - (int32_t)neo_count_leading_zeros(num);
+}
+
+// returns the bit number of the least significant one in num
+// if there is no one in num (i.e num is zero), it returns 32
+static inline uint32_t neo_least_sig_one(uint32_t num)
+{
+    return neo_count_leading_zeros(__RBIT(num));
+}
+
+// returns the bits of num above bit; 2U << 31 wraps to zero, which leaves nothing above bit 31
+static inline uint32_t neo_bits_above(uint32_t num, uint32_t bit)
+{
+    return num & ~((2U << bit) - 1U);
+}
+
+static inline void neo_bitmap_set(volatile neo_thread_bitmap_t *bitmap, uint32_t index)
+{
+    bitmap->leaf[index >> 5] |= 1U << (index & 31U);
+    bitmap->summary |= 1U << (index >> 5);
+}
+
+static inline void neo_bitmap_clear(volatile neo_thread_bitmap_t *bitmap, uint32_t index)
+{
+    bitmap->leaf[index >> 5] &= ~(1U << (index & 31U));
+    if (!bitmap->leaf[index >> 5])
+    {
+        bitmap->summary &= ~(1U << (index >> 5));
+    }
+}
+
+static inline bool neo_bitmap_test(const volatile neo_thread_bitmap_t *bitmap, uint32_t index)
+{
+    return (bitmap->leaf[index >> 5] >> (index & 31U)) & 1U;
+}
+
+static inline bool neo_bitmap_is_empty(const volatile neo_thread_bitmap_t *bitmap)
+{
+    return !bitmap->summary;
+}
+
+// returns the highest index in the bitmap; -1 if the bitmap is empty
+static inline int32_t neo_bitmap_highest(const volatile neo_thread_bitmap_t *bitmap)
+{
+    int32_t word = neo_most_sig_one(bitmap->summary);
+    if (word < 0)
+    {
+        return -1;
+    }
+    return word * 32 + neo_most_sig_one(bitmap->leaf[word]);
+}
+
+// returns the lowest index in the bitmap; the bitmap must not be empty
+static inline uint32_t neo_bitmap_lowest(const volatile neo_thread_bitmap_t *bitmap)
+{
+    uint32_t word = neo_least_sig_one(bitmap->summary);
+    return word * 32U + neo_least_sig_one(bitmap->leaf[word]);
+}
+
+// returns the lowest index above index, wrapping around to the lowest index in the bitmap; the bitmap must not be empty
+static inline uint32_t neo_bitmap_next_after(const volatile neo_thread_bitmap_t *bitmap, uint32_t index)
+{
+    uint32_t word = index >> 5;
+    uint32_t bits = neo_bits_above(bitmap->leaf[word], index & 31U);
+    if (bits)
+    {
+        return word * 32U + neo_least_sig_one(bits);
+    }
+
+    uint32_t words = neo_bits_above(bitmap->summary, word);
+    if (words)
+    {
+        word = neo_least_sig_one(words);
+        return word * 32U + neo_least_sig_one(bitmap->leaf[word]);
+    }
+
+    return neo_bitmap_lowest(bitmap);
+}
+
+#endif // NEO_BITMAP_H
@@ -0,0 +1,65 @@
+#ifndef NEO_CLOCK_H
+#define NEO_CLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "core_cm4.h"
+#include "neo_critical.h"
+
+/* Microsecond clocksource
+ *
+ * TIM5, a 32-bit timer, free-runs at 1 MHz next to the millisecond SysTick; its counter is the time in microseconds,
+ * wrapping every 71.6 minutes. One-shot timers are kept in a list sorted by deadline and compare channel 1 is always
+ * programmed for the earliest one, so the timer interrupts only when something is due instead of at a fixed rate
+ * Deadlines are compared modulo 2^32, so a delay has to stay below 2^31 us (about 35 minutes, NEO_CLOCK_MAX_DELAY_US);
+ * neo_thread_sleep_us takes longer sleeps by splitting them
+ *
+ * Timer callbacks run in the TIM5 interrupt with the kernel unlocked; keep them short and use the _from_isr calls in
+ * them. Only privileged code can start and cancel timers, since their callbacks run privileged
+ */
+
+// frequency TIM5 is clocked at; APB1 runs undivided from the 16 MHz HSI out of reset
+#ifndef NEO_CLOCK_TIMER_HZ
+#define NEO_CLOCK_TIMER_HZ (16000000U)
+#endif
+
+// interrupt priority of TIM5; wakeups are only as precise as the longest stretch this priority is masked for
+// its callbacks wake threads, so it can't be above the kernel ceiling
+#ifndef NEO_CLOCK_IRQ_PRIORITY
+#define NEO_CLOCK_IRQ_PRIORITY (NEO_KERNEL_CEILING)
+#endif
+
+// longest delay a clock timer or a single sleep can be given; deadlines are compared modulo 2^32
+#define NEO_CLOCK_MAX_DELAY_US ((1U << 31) - 1U)
+
+// neo_thread_sleep_us busy-waits instead of blocking for sleeps this short, which a context switch would overshoot
+#ifndef NEO_CLOCK_SPIN_US
+#define NEO_CLOCK_SPIN_US (20U)
+#endif
+
+typedef struct neo_clock_timer
+{
+    uint32_t deadline;                     // counter value the timer expires at
+    void (*callback)(void *arg);           // run from the TIM5 interrupt once the deadline passes
+    void *arg;                             // passed to callback
+    struct neo_clock_timer *volatile next; // next pending timer, later deadline
+    volatile bool pending;                 // in the pending list
+} neo_clock_timer_t;
+
+// current time in microseconds
+static inline uint32_t neo_clock_now_us(void)
+{
+    return TIM5->CNT;
+}
+
+void neo_clock_init(void);
+bool neo_clock_timer_start(neo_clock_timer_t *timer, uint32_t delay_us, void (*callback)(void *arg), void *arg);
+bool neo_clock_timer_cancel(neo_clock_timer_t *timer);
+void neo_thread_sleep_us(uint32_t us);
+
+#ifdef NEO_PROFILE
+#include "neo_profile.h"
+extern neo_profile_stat_t neo_clock_lateness; // microseconds between a timer's deadline and its callback
+#endif
+
+#endif // NEO_CLOCK_H
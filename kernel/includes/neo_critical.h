@@ -0,0 +1,89 @@
+#ifndef NEO_CRITICAL_H
+#define NEO_CRITICAL_H
+
+#include <stdint.h>
+#include "core_cm4.h"
+
+/* Kernel critical sections
+ *
+ * The kernel protects its data by raising BASEPRI to the kernel ceiling instead of masking every interrupt with
+ * PRIMASK: interrupts at the ceiling priority and below are held off, interrupts above it (numerically lower
+ * priorities) are never delayed by the kernel. The price is that handlers above the ceiling must not call any kernel
+ * function, not even the _from_isr ones
+ * SysTick, SVCall and the TIM5 clocksource run at the ceiling; PendSV stays at the lowest priority
+ *
+ * Critical sections don't nest: neo_kernel_unlock drops BASEPRI to zero, so a function that takes the lock must never
+ * be called with it held; kernel functions meant to run inside a critical section say so and leave the lock to their
+ * caller. They do nothing in unprivileged threads, which reach the kernel through SVC
+ *
+ * With NEO_PROFILE, every critical section is timed and the longest one per function is kept in neo_critical_windows
+ */
+
+// NVIC priority (0 to 15) of the kernel ceiling; set it at compile time with -DNEO_KERNEL_CEILING=<n>
+// priorities 0 to NEO_KERNEL_CEILING - 1 are left to handlers that must never be delayed by the kernel
+#ifndef NEO_KERNEL_CEILING
+#define NEO_KERNEL_CEILING (5U)
+#endif
+
+_Static_assert(NEO_KERNEL_CEILING >= 1U && NEO_KERNEL_CEILING < (1U << __NVIC_PRIO_BITS), "BASEPRI of zero masks nothing, so the ceiling can't be priority 0");
+
+// the ceiling as a BASEPRI value; the implemented priority bits are the top bits of the byte
+#define NEO_KERNEL_BASEPRI (NEO_KERNEL_CEILING << (8U - __NVIC_PRIO_BITS))
+
+static inline void neo_critical_enter(void)
+{
+    __set_BASEPRI(NEO_KERNEL_BASEPRI);
+    __ISB(); // the new mask is in effect from the next instruction on
+}
+
+static inline void neo_critical_exit(void)
+{
+    __set_BASEPRI(0U);
+}
+
+#ifdef NEO_PROFILE
+
+#include "neo_profile.h"
+
+#ifndef NEO_CRITICAL_SITES
+#define NEO_CRITICAL_SITES (64U)
+#endif
+
+typedef struct
+{
+    const char *function; // function the critical section is in
+    uint32_t max;         // longest time BASEPRI was raised there, in cycles
+    uint32_t count;       // number of critical sections measured there
+} neo_critical_window_t;
+
+extern neo_critical_window_t neo_critical_windows[NEO_CRITICAL_SITES];
+extern uint32_t neo_critical_entered_at;
+extern const char *neo_critical_function;
+
+void neo_critical_record(const char *function, uint32_t cycles);
+
+static inline void neo_critical_enter_profiled(const char *function)
+{
+    neo_critical_enter();
+    neo_critical_entered_at = neo_profile_cycles();
+    neo_critical_function = function;
+}
+
+// the window is recorded while still inside it, so it doesn't race with other critical sections
+static inline void neo_critical_exit_profiled(void)
+{
+    neo_critical_record(neo_critical_function, neo_profile_cycles() - neo_critical_entered_at);
+    neo_critical_exit();
+}
+
+#define neo_kernel_lock() neo_critical_enter_profiled(__func__)
+#define neo_kernel_unlock() neo_critical_exit_profiled()
+
+#else
+
+#define neo_kernel_lock() neo_critical_enter()
+#define neo_kernel_unlock() neo_critical_exit()
+
+#endif // NEO_PROFILE
+
+#endif // NEO_CRITICAL_H
@@ -0,0 +1,93 @@
+#ifndef NEO_KERNEL_H
+#define NEO_KERNEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "neo_threads.h"
+#include "neo_critical.h"
+
+/* Kernel internals shared by the synchronization primitives; applications use neo_threads.h and synchronization.h */
+
+#define NEO_NO_THREAD (0xFFU) // end of a thread list; never a listed thread's id since only the idle thread can have id 255
+
+/* Threads blocked on an object, highest priority first and in arrival order within a priority
+ * The list is linked through the kernel's per-thread wait links, so the object only holds the head;
+ * a thread waits on at most one object at a time
+ */
+typedef struct
+{
+    volatile uint8_t head;
+} neo_wait_queue_t;
+
+#define NEO_WAIT_QUEUE_INIT {NEO_NO_THREAD}
+
+/* Outcome of a blocking call; the kernel side returns NEO_WAIT_PENDING when it blocked the caller, since the thread
+ * only learns how the wait ended once it runs again
+ */
+#define NEO_WAIT_OK (0U)      // woken by the object
+#define NEO_WAIT_TIMEOUT (1U) // the timeout ran out, or a zero timeout found nothing
+#define NEO_WAIT_PENDING (2U) // blocked; see neo_kernel_wait_outcome
+
+#define NEO_WAIT_FOREVER (0xFFFFFFFFU) // timeout that never runs out
+
+extern volatile uint32_t curr_running_thread_index;
+extern volatile uint32_t is_first_time;
+extern volatile neo_thread_t *volatile thread_queue[MAX_THREADS + 1];
+extern volatile uint8_t wait_result[MAX_THREADS];
+extern void *volatile wait_data[MAX_THREADS];
+
+// true when called from a thread once the scheduler runs; not from main before that and not from a handler
+static inline bool neo_kernel_in_thread(void)
+{
+    return !__get_IPSR() && !is_first_time;
+}
+
+static inline uint32_t neo_kernel_current_thread(void)
+{
+    return curr_running_thread_index;
+}
+
+// true if thread is the structure of a thread the kernel knows; syscalls check their thread arguments with it, since a
+// caller can pass any address. Thread structures are in kernel RAM (see neo_thread_init), where nobody else writes them
+static inline bool neo_kernel_is_thread(const neo_thread_t *thread)
+{
+    return neo_mpu_in_kernel_ram(thread, sizeof(*thread)) && thread->thread_id < MAX_THREADS && thread_queue[thread->thread_id] == thread;
+}
+
+// the thread's current (possibly inherited) priority
+static inline uint8_t neo_kernel_priority(uint32_t index)
+{
+    return thread_queue[index]->priority;
+}
+
+// turns what the kernel side of a blocking call returned into its final outcome; call it from the blocked thread
+static inline uint32_t neo_kernel_wait_outcome(uint32_t status)
+{
+    return status == NEO_WAIT_PENDING ? wait_result[curr_running_thread_index] : status;
+}
+
+// the word handed to the calling thread with its last wait; only meaningful when the wait ended with NEO_WAIT_OK
+static inline void *neo_kernel_wait_data(void)
+{
+    return wait_data[curr_running_thread_index];
+}
+
+static inline void neo_wait_queue_init(neo_wait_queue_t *queue)
+{
+    queue->head = NEO_NO_THREAD;
+}
+
+static inline bool neo_wait_queue_is_empty(const neo_wait_queue_t *queue)
+{
+    return queue->head == NEO_NO_THREAD;
+}
+
+/* All of these must be called with the kernel locked (see neo_critical.h) */
+uint32_t neo_kernel_block_current(neo_wait_queue_t *queue, uint32_t timeout);
+uint32_t neo_kernel_block_current_on(const void *object, uint32_t timeout);
+uint32_t neo_kernel_wake_one(neo_wait_queue_t *queue);
+void neo_kernel_wake(uint32_t index);
+bool neo_kernel_is_waiting_for(uint32_t index, const void *object);
+void neo_kernel_set_priority(uint32_t index, uint8_t priority);
+
+#endif // NEO_KERNEL_H
@@ -0,0 +1,37 @@
+#ifndef NEO_MPU_H
+#define NEO_MPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "core_cm4.h"
+
+/* Memory protection
+ *
+ * Regions 0 to 3 are static and give unprivileged threads flash (read-only), SRAM and the peripherals; privileged code
+ * uses the default memory map for everything else (MPU_CTRL.PRIVDEFENA)
+ * The top of SRAM is kernel RAM (see linker_script.ld), which unprivileged threads can only read: the kernel's
+ * variables, every thread structure and the stacks of privileged threads go there, so a user thread can neither
+ * corrupt the kernel nor raise its own privilege. Exception entry stacks with the privilege of the thread, so a thread
+ * that points its stack pointer into kernel RAM faults before PendSV saves anything there
+ * Region NEO_MPU_GUARD_REGION is reloaded on every context switch from the incoming thread's TCB; it covers the
+ * bottom NEO_MPU_GUARD_SIZE bytes of the thread's stack with no access for anyone, so a stack overflow raises a
+ * MemManage fault (even while the hardware or PendSV is stacking the thread's context) instead of corrupting memory
+ * Region 5 does the same, for everyone, for the bottom NEO_MPU_GUARD_SIZE bytes of the main stack, which the handlers
+ * run on; a handler that overflows it locks the core up or faults instead of writing over the kernel's data
+ */
+
+#define NEO_MPU_GUARD_SIZE (32U)  // smallest MPU region; the guard base must be aligned to it
+#define NEO_MPU_GUARD_REGION (4U) // above the SRAM and kernel RAM regions, so the guard wins where they overlap
+
+/* Place a variable in kernel RAM. NEO_KERNEL_DATA is for variables with an initializer other than zero, which are loaded
+ * from flash like .data; NEO_KERNEL_BSS is for the rest, which reset_handler zeroes like .bss and which cost no flash.
+ * A nonzero initializer on a NEO_KERNEL_BSS variable is lost */
+#define NEO_KERNEL_DATA __attribute__((section(".kernel_data")))
+#define NEO_KERNEL_BSS __attribute__((section(".kernel_bss")))
+
+void neo_mpu_init(void);
+uint8_t *neo_mpu_stack_guard(uint8_t *stack, uint32_t stack_size, ARM_MPU_Region_t *guard);
+bool neo_mpu_in_kernel_ram(const void *address, uint32_t size);
+bool neo_mpu_caller_can_write(const void *address, uint32_t size);
+
+#endif // NEO_MPU_H
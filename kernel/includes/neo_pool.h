@@ -0,0 +1,102 @@
+#ifndef NEO_POOL_H
+#define NEO_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "neo_mpu.h"
+
+/* Fixed-size block pools
+ *
+ * A pool hands out blocks of one size from memory set aside for it, in constant time and without fragmenting: a free
+ * block holds the link to the next free block in its first word (an intrusive free list), so taking or returning a
+ * block is a couple of loads and stores under the kernel lock. Blocks never handed out yet are taken in order from
+ * the untouched part of the storage, so a pool needs no initialization pass over its blocks
+ * Use them for objects that come in a few fixed sizes (message buffers, timers, thread structures and stacks) instead
+ * of the neo_alloc heap
+ *
+ * Pools can be used from handlers at or below the kernel ceiling and from privileged threads directly; unprivileged
+ * threads go through SVC. Freeing checks that the block belongs to the pool, but not that it is in use
+ */
+
+typedef struct
+{
+    void *free_list;      // most recently freed block; the first word of a free block points to the next one
+    uint8_t *blocks;      // storage of the pool's blocks, back to back
+    uint32_t block_size;  // bytes per block; a multiple of 4, at least one pointer
+    uint32_t block_count; // number of blocks in the storage
+    uint32_t next_unused; // index of the first block that was never handed out; blocks from here on aren't in free_list
+    uint32_t free_count;  // blocks that can still be taken
+} neo_pool_t;
+
+// size of each block of a pool for objects of the given size; rounded up to whole words
+#define NEO_POOL_BLOCK_SIZE(size) ((((size) < sizeof(void *) ? sizeof(void *) : (size)) + 3U) & ~3U)
+
+/* Declares a pool of count blocks of at least size bytes, together with its storage; the pool is ready to use without
+ * calling neo_pool_init. Both are static, so declare the pool at file scope in the file that uses it
+ */
+#define NEO_POOL(name, size, count)                                                                        \
+    static uint32_t name##_storage[NEO_POOL_BLOCK_SIZE(size) / 4U * (count)] __attribute__((aligned(8))); \
+    static neo_pool_t name = {NULL, (uint8_t *)name##_storage, NEO_POOL_BLOCK_SIZE(size), (count), 0U, (count)}
+
+// same as NEO_POOL, with the pool and its storage in kernel RAM; for pools of kernel objects
+#define NEO_KERNEL_POOL(name, size, count)                                                                                 \
+    NEO_KERNEL_BSS static uint32_t name##_storage[NEO_POOL_BLOCK_SIZE(size) / 4U * (count)] __attribute__((aligned(8)));  \
+    NEO_KERNEL_DATA static neo_pool_t name = {NULL, (uint8_t *)name##_storage, NEO_POOL_BLOCK_SIZE(size), (count), 0U, (count)}
+
+bool neo_pool_init(neo_pool_t *pool, void *storage, uint32_t block_size, uint32_t block_count);
+void *neo_pool_alloc(neo_pool_t *pool);
+bool neo_pool_free(neo_pool_t *pool, void *block);
+bool neo_pool_owns(const neo_pool_t *pool, const void *block);
+
+/* Kernel side; must be called with the kernel locked */
+void *neo_kernel_pool_take(neo_pool_t *pool);
+bool neo_kernel_pool_give(neo_pool_t *pool, void *block);
+
+/* Lock-free block pools
+ *
+ * Same idea as neo_pool_t, but the free list is a Treiber stack updated with LDREX/STREX instead of under the kernel
+ * lock, so any code can take and return blocks without masking interrupts: handlers of every priority, including those
+ * above the kernel ceiling, and unprivileged threads without a syscall. A taker or returner that is interrupted
+ * between its LDREX and STREX just retries
+ * The head of the stack is one word holding the index of the first free block and a tag that changes on every update,
+ * so a stale head never compares equal to the current one (the ABA problem); on this core the exclusive monitor is
+ * cleared by every exception anyway, the tag keeps the list safe wherever that doesn't hold
+ * Indices are 16 bits, so a pool holds at most NEO_LF_POOL_MAX_BLOCKS blocks
+ */
+
+#define NEO_LF_POOL_MAX_BLOCKS (0xFFFFU)
+
+typedef struct
+{
+    volatile uint32_t head;        // tag in the top 16 bits, index + 1 of the first free block below; 0 if none is free
+    volatile uint32_t next_unused; // index of the first block that was never handed out
+    uint8_t *blocks;               // storage of the pool's blocks, back to back
+    uint32_t block_size;           // bytes per block; a multiple of 4
+    uint32_t block_count;          // number of blocks in the storage
+} neo_lf_pool_t;
+
+/* Declares a lock-free pool of count blocks of at least size bytes, together with its storage; ready to use without
+ * calling neo_lf_pool_init. Both are static, so declare the pool at file scope in the file that uses it
+ */
+#define NEO_LF_POOL(name, size, count)                                                                     \
+    _Static_assert((count) <= NEO_LF_POOL_MAX_BLOCKS, "lock-free pool block indices are 16 bits");        \
+    static uint32_t name##_storage[NEO_POOL_BLOCK_SIZE(size) / 4U * (count)] __attribute__((aligned(8))); \
+    static neo_lf_pool_t name = {0U, 0U, (uint8_t *)name##_storage, NEO_POOL_BLOCK_SIZE(size), (count)}
+
+bool neo_lf_pool_init(neo_lf_pool_t *pool, void *storage, uint32_t block_size, uint32_t block_count);
+void *neo_lf_pool_alloc(neo_lf_pool_t *pool);
+bool neo_lf_pool_free(neo_lf_pool_t *pool, void *block);
+
+#ifdef NEO_PROFILE
+#include "neo_profile.h"
+extern neo_profile_stat_t neo_bench_pool_alloc[3]; // cycles per neo_pool_alloc of 16, 64 and 512 byte blocks
+extern neo_profile_stat_t neo_bench_pool_free[3];  // cycles per neo_pool_free of those blocks
+extern neo_profile_stat_t neo_bench_heap_alloc[3]; // cycles per neo_alloc of the same sizes, for comparison
+extern neo_profile_stat_t neo_bench_heap_free[3];  // cycles per neo_free of those blocks
+extern neo_profile_stat_t neo_bench_lf_pool_alloc[3]; // cycles per neo_lf_pool_alloc of the same sizes
+extern neo_profile_stat_t neo_bench_lf_pool_free[3];  // cycles per neo_lf_pool_free of those blocks
+void neo_profile_pool(void);
+#endif
+
+#endif // NEO_POOL_H
@@ -0,0 +1,60 @@
+#ifndef NEO_PROFILE_H
+#define NEO_PROFILE_H
+
+#include <stdint.h>
+#include "core_cm4.h"
+
+/* Cycle-count instrumentation built on the DWT cycle counter (CYCCNT)
+ * Only compiled in when NEO_PROFILE is defined (make PROFILE=1); otherwise every macro expands to nothing
+ * The collected statistics are plain globals so they can be read from gdb with "print <name>"
+ */
+
+typedef struct
+{
+    uint32_t last;  // cycles of the most recent sample
+    uint32_t min;   // fewest cycles seen
+    uint32_t max;   // most cycles seen
+    uint32_t count; // number of samples
+    uint32_t total; // sum of all samples; total / count gives the average
+} neo_profile_stat_t;
+
+#ifdef NEO_PROFILE
+
+static inline void neo_profile_init(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk; // enable the trace and debug blocks (DWT lives there)
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk; // start the cycle counter
+}
+
+static inline uint32_t neo_profile_cycles(void)
+{
+    return DWT->CYCCNT;
+}
+
+static inline void neo_profile_record(neo_profile_stat_t *stat, uint32_t cycles)
+{
+    if (!stat->count || cycles < stat->min)
+    {
+        stat->min = cycles;
+    }
+    if (cycles > stat->max)
+    {
+        stat->max = cycles;
+    }
+    stat->last = cycles;
+    stat->total += cycles;
+    stat->count++;
+}
+
+#define NEO_PROFILE_START(var) uint32_t var = neo_profile_cycles()
+#define NEO_PROFILE_END(stat, var) neo_profile_record(&(stat), neo_profile_cycles() - (var))
+
+#else
+
+#define NEO_PROFILE_START(var)
+#define NEO_PROFILE_END(stat, var)
+
+#endif // NEO_PROFILE
+
+#endif // NEO_PROFILE_H
@@ -0,0 +1,35 @@
+#ifndef NEO_QUEUE_H
+#define NEO_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "neo_kernel.h"
+
+/* Zero-copy message queue
+ *
+ * A fixed-capacity FIFO of pointers: the sender passes a whole buffer (typically a block from neo_alloc) and with it
+ * the ownership of the buffer; the receiver uses it in place and frees it or passes it on. No message bytes are copied
+ * A send to a waiting receiver hands the pointer over directly; a receive from a full queue pulls in the message of the
+ * highest-priority blocked sender. With a capacity of zero, every send waits for a receiver (rendezvous)
+ * Timeouts are in milliseconds; a timeout of zero never blocks and NEO_WAIT_FOREVER never runs out
+ * Handlers send with neo_queue_send_from_isr and can only receive with a zero timeout
+ */
+
+typedef struct
+{
+    void **slots;               // storage for capacity message pointers, provided by the user
+    uint32_t capacity;          // number of slots
+    volatile uint32_t head;     // slot of the oldest message
+    volatile uint32_t count;    // number of messages in the queue
+    neo_wait_queue_t receivers; // threads blocked on an empty queue, highest priority first
+    neo_wait_queue_t senders;   // threads blocked on a full queue, highest priority first
+} neo_queue_t;
+
+#define NEO_QUEUE_INIT(slots, capacity) {(slots), (capacity), 0, 0, NEO_WAIT_QUEUE_INIT, NEO_WAIT_QUEUE_INIT}
+
+void neo_queue_init(neo_queue_t *queue, void **slots, uint32_t capacity);
+bool neo_queue_send(neo_queue_t *queue, void *message, uint32_t timeout);
+bool neo_queue_send_from_isr(neo_queue_t *queue, void *message);
+bool neo_queue_receive(neo_queue_t *queue, void **message, uint32_t timeout);
+
+#endif // NEO_QUEUE_H
@@ -0,0 +1,124 @@
+#ifndef NEO_SYSCALL_H
+#define NEO_SYSCALL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "core_cm4.h"
+#include "neo_threads.h"
+#include "synchronization.h"
+#include "neo_queue.h"
+#include "neo_timer.h"
+#include "neo_pool.h"
+
+/* Supervisor calls into the kernel
+ *
+ * User threads run unprivileged (CONTROL.nPRIV set), so they can neither mask interrupts nor touch the
+ * System Control Space; every kernel call they make is an "svc #0" with the syscall number in r12 and up
+ * to four arguments in r0-r3. SVCall_handler looks the number up in neo_syscall_table and returns the
+ * result in the caller's r0.
+ *
+ * Handlers and privileged threads (main before the scheduler starts, the idle thread) call the kernel
+ * directly; the public API functions pick the path with neo_in_privileged_context
+ *
+ * An unprivileged caller can pass any address, so the kernel side only writes memory the caller could write itself
+ * (neo_mpu_caller_can_write), only takes thread structures the kernel knows (neo_kernel_is_thread), and checks every
+ * field of a caller's object it indexes with before using it
+ */
+
+// syscall numbers; each is an index into neo_syscall_table (neo_syscall.c), keep both in the same order
+typedef enum
+{
+    NEO_SYS_THREAD_START = 0,
+    NEO_SYS_THREAD_START_ALL_NEW,
+    NEO_SYS_THREAD_SLEEP,
+    NEO_SYS_THREAD_PAUSE,
+    NEO_SYS_THREAD_RESUME,
+    NEO_SYS_ALLOC,
+    NEO_SYS_FREE,
+    NEO_SYS_MUTEX_LOCK,
+    NEO_SYS_MUTEX_UNLOCK,
+    NEO_SYS_SEM_TAKE,
+    NEO_SYS_SEM_GIVE,
+    NEO_SYS_QUEUE_SEND,
+    NEO_SYS_QUEUE_RECEIVE,
+    NEO_SYS_EVENT_GROUP_WAIT,
+    NEO_SYS_EVENT_GROUP_SET,
+    NEO_SYS_EVENT_GROUP_CLEAR,
+    NEO_SYS_THREAD_EXIT,
+    NEO_SYS_THREAD_JOIN,
+    NEO_SYS_THREAD_CREATE,
+    NEO_SYS_THREAD_SLEEP_UNTIL,
+    NEO_SYS_THREAD_SLEEP_US,
+    NEO_SYS_TIMER_CREATE,
+    NEO_SYS_TIMER_START,
+    NEO_SYS_TIMER_STOP,
+    NEO_SYS_TIMER_DELETE,
+    NEO_SYS_TIMER_SERVICE,
+    NEO_SYS_SCHED_LOCK,
+    NEO_SYS_SCHED_UNLOCK,
+    NEO_SYS_POOL_ALLOC,
+    NEO_SYS_POOL_FREE,
+#ifdef NEO_PROFILE
+    NEO_SYS_PROFILE_NULL, // does nothing; neo_profile_syscall times the SVC round trip with it
+#endif
+    NEO_SYSCALL_COUNT
+} neo_syscall_number_t;
+
+// true in handler mode or in a privileged thread, where the kernel can be entered with a plain function call
+static inline bool neo_in_privileged_context(void)
+{
+    return __get_IPSR() || !(__get_CONTROL() & CONTROL_nPRIV_Msk);
+}
+
+// traps into the kernel; the number goes in r12 so one svc instruction serves every syscall
+static inline uint32_t neo_syscall(uint32_t number, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3)
+{
+    register uint32_t r0 __asm__("r0") = arg0;
+    register uint32_t r1 __asm__("r1") = arg1;
+    register uint32_t r2 __asm__("r2") = arg2;
+    register uint32_t r3 __asm__("r3") = arg3;
+    register uint32_t r12 __asm__("r12") = number;
+    __asm__ volatile("svc #0" : "+r"(r0) : "r"(r1), "r"(r2), "r"(r3), "r"(r12) : "memory");
+    return r0;
+}
+
+/* Kernel side of the syscalls; run in handler mode or in a privileged thread only */
+bool neo_sys_thread_start(neo_thread_t *thread);
+void neo_sys_thread_start_all_new(void);
+void neo_sys_thread_sleep(uint32_t time);
+bool neo_sys_thread_sleep_until(uint32_t *last_wake, uint32_t period);
+void neo_sys_thread_sleep_us(uint32_t us);
+neo_timer_t *neo_sys_timer_create(uint32_t period, bool one_shot, void (*callback)(void *arg), void *arg);
+bool neo_sys_timer_start(neo_timer_t *timer);
+bool neo_sys_timer_stop(neo_timer_t *timer);
+bool neo_sys_timer_delete(neo_timer_t *timer);
+uint32_t neo_sys_timer_service(void);
+void neo_sys_sched_lock(void);
+void neo_sys_sched_unlock(void);
+void *neo_sys_pool_alloc(neo_pool_t *pool);
+bool neo_sys_pool_free(neo_pool_t *pool, void *block);
+void neo_sys_thread_pause(void);
+bool neo_sys_thread_resume(neo_thread_t *thread);
+void *neo_sys_alloc(uint32_t size);
+void neo_sys_free(void *ptr);
+bool neo_sys_mutex_lock(neo_mutex_t *mutex);
+bool neo_sys_mutex_unlock(neo_mutex_t *mutex);
+uint32_t neo_sys_sem_take(neo_sem_t *sem, uint32_t timeout);
+bool neo_sys_sem_give(neo_sem_t *sem);
+uint32_t neo_sys_queue_send(neo_queue_t *queue, void *message, uint32_t timeout);
+uint32_t neo_sys_queue_receive(neo_queue_t *queue, void **message, uint32_t timeout);
+uint32_t neo_sys_event_group_wait(neo_event_group_t *group, uint32_t bits, uint32_t options, uint32_t timeout);
+uint32_t neo_sys_event_group_set(neo_event_group_t *group, uint32_t bits);
+uint32_t neo_sys_event_group_clear(neo_event_group_t *group, uint32_t bits);
+void neo_sys_thread_exit(void);
+uint32_t neo_sys_thread_join(neo_thread_t *thread, uint32_t timeout);
+neo_thread_t *neo_sys_thread_create(void (*thread_function)(void *), void *thread_arg, uint32_t stack_size, uint8_t priority);
+
+#ifdef NEO_PROFILE
+#include "neo_profile.h"
+extern neo_profile_stat_t neo_bench_syscall;      // cycles per SVC round trip of a syscall that does nothing
+extern neo_profile_stat_t neo_bench_syscall_call; // cycles per direct call of the same function, for comparison
+void neo_profile_syscall(void);
+#endif
+
+#endif // NEO_SYSCALL_H
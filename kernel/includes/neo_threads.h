@@ -5,20 +5,76 @@
 #include <stdbool.h>
 #include "system_core.h"
 #include "core_cm4.h"
+#include "neo_mpu.h"
 
-/* if the structure is ever changed, please update the requisite hardcoded values in the udpate sleeping threads function */
-typedef struct __attribute__((packed))
+/* Maximum number of concurrent threads, not counting the idle thread; set it at compile time with make MAX_THREADS=<n>
+ * The thread state masks are two-level bitmaps (see neo_bitmap.h) sized from this value; thread ids are 8 bits wide,
+ * so up to 255 threads plus the idle thread are supported
+ */
+#ifndef MAX_THREADS
+#define MAX_THREADS (10U)
+#endif
+
+#include "neo_bitmap.h"
+
+/* System tick period in milliseconds; set it at compile time with -DNEO_TICK_MS=<n>
+ * Sleeps and timeouts are given in milliseconds and rounded up to whole ticks; tick_count (get_tick_count) counts ticks
+ */
+#ifndef NEO_TICK_MS
+#define NEO_TICK_MS (1U)
+#endif
+
+// milliseconds to ticks, rounded up; doesn't overflow for any 32-bit value
+#define NEO_MS_TO_TICKS(ms) ((ms) / NEO_TICK_MS + ((ms) % NEO_TICK_MS != 0U))
+
+/* Thread priorities; a larger number means a higher priority
+ * The levels must fit in one 32-bit word so that the highest ready priority is found with a single CLZ
+ * Priority 0 is reserved for the idle thread; user threads use 1 to NEO_MAX_PRIORITY
+ */
+#ifndef NEO_PRIORITY_LEVELS
+#define NEO_PRIORITY_LEVELS (32U)
+#endif
+#define NEO_IDLE_PRIORITY (0U)
+#define NEO_MIN_PRIORITY (1U)
+#define NEO_MAX_PRIORITY (NEO_PRIORITY_LEVELS - 1U)
+
+/* Declares a thread stack that starts on a guard boundary, so the MPU stack guard takes exactly its bottom NEO_MPU_GUARD_SIZE bytes
+ * Prefix it with NEO_KERNEL_BSS for a privileged thread (see neo_thread_set_privileged) */
+#define NEO_THREAD_STACK(name, words) uint32_t name[words] __attribute__((aligned(NEO_MPU_GUARD_SIZE)))
+
+/* stack_ptr must stay the first member; the context switch code loads and stores it through the struct pointer directly */
+/* the other members are reached from assembly through offsetof, so they can be rearranged freely */
+/* mpu_guard is loaded with ldm, so it must stay word aligned; hence the aligned attribute */
+typedef struct __attribute__((packed, aligned(4)))
 {
     uint8_t *stack_ptr;
-    uint8_t thread_id; // unique thread id; actually the thread's index in the thread queue
+    ARM_MPU_Region_t mpu_guard; // RBAR and RASR of the no-access region below the stack; written to the MPU on every switch
+    uint8_t thread_id;     // unique thread id; actually the thread's index in the thread queue
+    uint8_t priority;      // scheduling priority; raised above base_priority while the thread holds a mutex a higher-priority thread waits on
+    uint8_t base_priority; // priority the thread was created with
+    uint8_t unprivileged;  // copied into CONTROL.nPRIV when the thread is switched in; 1 for user threads
 } neo_thread_t;
 
-bool neo_thread_init(neo_thread_t *thread, void (*thread_function)(void *), void *thread_arg, uint8_t *stack, uint32_t stack_size);
+bool neo_thread_init(neo_thread_t *thread, void (*thread_function)(void *), void *thread_arg, uint8_t *stack, uint32_t stack_size, uint8_t priority);
 void neo_kernel_init(void);
-__attribute__((naked)) void neo_thread_sleep(uint32_t time);
-__attribute__((naked)) void neo_thread_pause(void);
-__attribute__((naked)) bool neo_thread_resume(neo_thread_t *thread);
-__attribute__((naked)) bool neo_thread_start(neo_thread_t *thread);
+void neo_thread_sleep(uint32_t time);
+bool neo_thread_sleep_until(uint32_t *last_wake, uint32_t period);
+void neo_thread_pause(void);
+bool neo_thread_resume(neo_thread_t *thread);
+bool neo_thread_start(neo_thread_t *thread);
 void neo_thread_start_all_new(void);
+bool neo_thread_set_privileged(neo_thread_t *thread, bool privileged);
+void neo_thread_exit(void) __attribute__((noreturn));
+bool neo_thread_join(neo_thread_t *thread, uint32_t timeout);
+neo_thread_t *neo_thread_create(void (*thread_function)(void *), void *thread_arg, uint32_t stack_size, uint8_t priority);
+void neo_sched_lock(void);
+void neo_sched_unlock(void);
+
+#ifdef NEO_PROFILE
+void neo_profile_scheduler(void);
+void neo_profile_sleep_queue(void);
+void neo_profile_thread_create(void);
+void neo_profile_periodic(void *arg);
+#endif
 
-#endif
\ No newline at end of file
+#endif
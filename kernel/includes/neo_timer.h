@@ -0,0 +1,54 @@
+#ifndef NEO_TIMER_H
+#define NEO_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "neo_threads.h"
+
+/* Software timers
+ *
+ * Periodic and one-shot callbacks that run in a kernel timer thread instead of each periodic job needing a thread and
+ * a stack of its own. Active timers are kept in a list sorted by expiry tick; the timer thread sleeps until the
+ * earliest one is due, then collects every timer due by that tick in a single kernel call and runs their callbacks
+ * back to back, so timers expiring on the same tick cost one wakeup and one context switch between them
+ * Periodic timers are rearmed from their previous expiry rather than from when their callback ran, so they don't drift;
+ * periods that were missed altogether are skipped
+ *
+ * Callbacks run unprivileged in the timer thread; they must not block for long, since they hold up every other timer
+ * The timer thread and its stack are only set up when the first timer is created
+ * Periods are in milliseconds, rounded up to whole ticks
+ */
+
+// number of timers that can exist at once; set it at compile time with -DNEO_TIMERS=<n>
+#ifndef NEO_TIMERS
+#define NEO_TIMERS (8U)
+#endif
+
+// the timer thread runs callbacks at this priority
+#ifndef NEO_TIMER_THREAD_PRIORITY
+#define NEO_TIMER_THREAD_PRIORITY (NEO_MAX_PRIORITY)
+#endif
+
+// stack of the timer thread in words, guard included; every callback runs on it
+#ifndef NEO_TIMER_STACK_WORDS
+#define NEO_TIMER_STACK_WORDS (128U)
+#endif
+
+typedef struct neo_timer
+{
+    uint32_t expiry;             // tick the timer is due at
+    uint32_t period;             // ticks between expiries
+    void (*callback)(void *arg); // run in the timer thread
+    void *arg;                   // passed to callback
+    struct neo_timer *next;      // next active timer, later expiry
+    bool one_shot;               // stopped after expiring once instead of rearmed
+    bool active;                 // in the list of active timers
+    bool in_use;                 // created and not yet deleted
+} neo_timer_t;
+
+neo_timer_t *neo_timer_create(uint32_t period, bool one_shot, void (*callback)(void *arg), void *arg);
+bool neo_timer_start(neo_timer_t *timer);
+bool neo_timer_stop(neo_timer_t *timer);
+bool neo_timer_delete(neo_timer_t *timer);
+
+#endif // NEO_TIMER_H
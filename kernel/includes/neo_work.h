@@ -0,0 +1,41 @@
+#ifndef NEO_WORK_H
+#define NEO_WORK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "neo_threads.h"
+
+/* Deferred interrupt work
+ *
+ * A handler posts a (function, argument) pair and returns; a privileged kernel worker thread runs the posted items in
+ * order. This keeps handlers short, so the interrupts behind them wait less
+ * The queue is a lock-free ring: posting claims a slot with one LDREX/STREX on the tail and publishes it with a plain
+ * store, so it doesn't lock the kernel and handlers (and privileged threads) can post, even while preempting each
+ * other. The kernel is only locked briefly to wake the worker when it sleeps on an empty queue, which is why handlers
+ * above the kernel ceiling can't post
+ * Only privileged code can post, since the items run privileged
+ * With NEO_PROFILE, every item is timed from its post to the worker starting it; posting first thing in a handler makes
+ * that the latency from handler entry to the deferred work starting
+ */
+
+// number of items the queue holds; a power of two
+#ifndef NEO_WORK_ITEMS
+#define NEO_WORK_ITEMS (16U)
+#endif
+
+// stack of the worker thread in words, guard included; every item runs on it
+#ifndef NEO_WORK_STACK_WORDS
+#define NEO_WORK_STACK_WORDS (128U)
+#endif
+
+bool neo_work_init(uint8_t priority);
+bool neo_work_post(void (*function)(void *arg), void *arg);
+
+#ifdef NEO_PROFILE
+#include "neo_profile.h"
+extern neo_profile_stat_t neo_bench_work_post;      // cycles spent in neo_work_post that queued an item
+extern neo_profile_stat_t neo_bench_work_post_full; // cycles spent in neo_work_post turned away by a full queue; count is how often
+extern neo_profile_stat_t neo_bench_work_latency;   // cycles from an item being posted to it starting to run
+#endif
+
+#endif // NEO_WORK_H
@@ -1,6 +1,87 @@
 #ifndef SYNCHRONIZATION_H
 #define SYNCHRONIZATION_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "neo_kernel.h"
+
 /* There are synchronization instruction primitives in Cortex M4; See Section 2.2.7 of the programmer's manual*/
 
-#endif // SYNCHRONIZATION_H
\ No newline at end of file
+/* Mutex with priority inheritance
+ *
+ * Taking a free mutex or releasing one nobody waits for is a single LDREX/STREX pair on the owner word, done by the
+ * calling thread itself: no interrupt masking, no syscall and no PendSV. Only contention enters the kernel: the
+ * waiter sets NEO_MUTEX_CONTENDED, queues itself by priority and lends its priority to the owner; the release hands
+ * the mutex straight to the highest-priority waiter and drops the owner back to the highest priority it still inherits
+ *
+ * Mutexes are for threads only; they are not recursive, and inheritance is not passed on to the owner of a mutex the
+ * owner itself is blocked on
+ */
+
+#define NEO_MUTEX_CONTENDED (1U << 31) // set in owner while threads are waiting
+
+typedef struct neo_mutex
+{
+    volatile uint32_t owner;  // 0 if free; otherwise the owner's thread id + 1, or'ed with NEO_MUTEX_CONTENDED
+    neo_wait_queue_t waiters; // threads blocked on the mutex, highest priority first
+} neo_mutex_t;
+
+#define NEO_MUTEX_INIT {0, NEO_WAIT_QUEUE_INIT}
+
+void neo_mutex_init(neo_mutex_t *mutex);
+bool neo_mutex_lock(neo_mutex_t *mutex);
+bool neo_mutex_unlock(neo_mutex_t *mutex);
+
+/* Counting semaphore
+ *
+ * A give with threads waiting hands the count straight to the highest-priority waiter, which is O(1) since waiters are
+ * kept sorted; otherwise it increments the count up to the semaphore's limit
+ * Timeouts are in milliseconds; a timeout of zero never blocks and NEO_WAIT_FOREVER never runs out
+ * Handlers give with neo_sem_give_from_isr and can only take with a zero timeout
+ */
+
+typedef struct
+{
+    volatile uint32_t count;
+    uint32_t limit;           // highest count; a give at the limit with nobody waiting fails
+    neo_wait_queue_t waiters; // threads blocked in neo_sem_take, highest priority first
+} neo_sem_t;
+
+#define NEO_SEM_INIT(initial_count, limit) {(initial_count), (limit), NEO_WAIT_QUEUE_INIT}
+
+void neo_sem_init(neo_sem_t *sem, uint32_t initial_count, uint32_t limit);
+bool neo_sem_take(neo_sem_t *sem, uint32_t timeout);
+bool neo_sem_give(neo_sem_t *sem);
+bool neo_sem_give_from_isr(neo_sem_t *sem);
+
+/* Event flag group
+ *
+ * A 32-bit flag word threads can block on until any (or, with NEO_EVENT_WAIT_ALL, all) of a set of bits are set,
+ * optionally clearing those bits when the wait is satisfied (NEO_EVENT_CLEAR_ON_EXIT)
+ * Waiting threads are kept in a thread bitmap, like the ready threads, so setting bits checks every waiter in one pass
+ * over the set bits and wakes all the satisfied ones; the clears they asked for are applied after the pass, so waiters
+ * satisfied by the same set all see the same flags
+ * Timeouts are in milliseconds; a timeout of zero never blocks and NEO_WAIT_FOREVER never runs out
+ * Handlers set bits with neo_event_group_set_from_isr and can only wait with a zero timeout
+ */
+
+#define NEO_EVENT_WAIT_ALL (1U << 0)      // wait until all the bits are set instead of any of them
+#define NEO_EVENT_CLEAR_ON_EXIT (1U << 1) // clear the waited-for bits when the wait is satisfied
+
+typedef struct
+{
+    volatile uint32_t flags;
+    volatile neo_thread_bitmap_t waiters; // threads blocked in neo_event_group_wait
+} neo_event_group_t;
+
+#define NEO_EVENT_GROUP_INIT {0}
+
+void neo_event_group_init(neo_event_group_t *group);
+uint32_t neo_event_group_wait(neo_event_group_t *group, uint32_t bits, uint32_t options, uint32_t timeout);
+uint32_t neo_event_group_set(neo_event_group_t *group, uint32_t bits);
+uint32_t neo_event_group_set_from_isr(neo_event_group_t *group, uint32_t bits);
+uint32_t neo_event_group_clear(neo_event_group_t *group, uint32_t bits);
+uint32_t neo_event_group_get(neo_event_group_t *group);
+
+#endif // SYNCHRONIZATION_H
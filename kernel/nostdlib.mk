@@ -40,6 +40,26 @@ COMMON_FLAGS = -mcpu=cortex-m4 \
                -I$(CORE_INC_DIR) \
                -I$(STM_INC_DIR)
 
+# Optional kernel profiling; "make PROFILE=1" compiles in the DWT cycle-counter instrumentation (see neo_profile.h)
+ifeq ($(PROFILE),1)
+COMMON_FLAGS += -DNEO_PROFILE
+endif
+
+# Thread limit; "make MAX_THREADS=40" sizes the thread tables and state bitmaps for 40 threads (up to 255)
+ifdef MAX_THREADS
+COMMON_FLAGS += -DMAX_THREADS=$(MAX_THREADS)U
+endif
+
+# Tickless idle is on by default; "make TICKLESS=0" keeps the periodic tick running while idle
+ifeq ($(TICKLESS),0)
+COMMON_FLAGS += -DNEO_TICKLESS_IDLE=0
+endif
+
+# Kernel ceiling; "make CEILING=3" leaves NVIC priorities 0 to 2 to handlers the kernel never masks (see neo_critical.h)
+ifdef CEILING
+COMMON_FLAGS += -DNEO_KERNEL_CEILING=$(CEILING)U
+endif
+
 # Release build flags - Maximum optimization for size and performance
 # -Os: Optimize for size while maintaining performance
 RELEASE_FLAGS = $(COMMON_FLAGS) \
@@ -5,17 +5,24 @@
 #include "system_core.h"
 #include "neo_threads.h"
 #include "neo_alloc.h"
+#include "neo_pool.h"
+#include "neo_syscall.h"
 #include <string.h>
 #include <stdlib.h>
 
 #define PIN5 5
 
-neo_thread_t thread_one;
-neo_thread_t thread_two;
+NEO_KERNEL_BSS neo_thread_t thread_one; // thread structures go in kernel RAM
+NEO_KERNEL_BSS neo_thread_t thread_two;
 
-/* This kernel works currently only without the floating-point hardware being enabled */
+/* The FPU is enabled; a thread that uses floating point needs 34 more words of stack for its FPU context */
 
-uint32_t thread_one_stack[40];
+NEO_THREAD_STACK(thread_one_stack, 48); // 40 words plus the 8-word stack guard
+
+#ifdef NEO_PROFILE
+NEO_KERNEL_BSS neo_thread_t periodic_thread;
+NEO_KERNEL_BSS NEO_THREAD_STACK(periodic_thread_stack, 128); // privileged, so its stack is in kernel RAM too
+#endif
 void thread_two_fxn(void *arg)
 {
     (int *)arg++;
@@ -25,7 +32,7 @@ void thread_two_fxn(void *arg)
     bool is_on = false;
     while (true)
     {
-        if (has_time_passed(5, start)) // checks if a second is passed since each tick value represents 100 ms
+        if (has_time_passed(NEO_MS_TO_TICKS(500U), start)) // checks if half a second has passed; tick_count counts NEO_TICK_MS ticks
         {
             start = get_tick_count();
             if (is_on)
@@ -48,7 +55,7 @@ void thread_two_fxn(void *arg)
     }
 }
 
-uint32_t thread_two_stack[40];
+NEO_THREAD_STACK(thread_two_stack, 48);
 void thread_one_fxn(void *arg)
 {
     (int *)arg++;
@@ -56,7 +63,7 @@ void thread_one_fxn(void *arg)
     bool is_on = false;
     while (true)
     {
-        if (has_time_passed(5, start))
+        if (has_time_passed(NEO_MS_TO_TICKS(500U), start))
         {
             start = get_tick_count();
             if (is_on)
@@ -80,8 +87,8 @@ int main(void)
     LED_setup();
     neo_kernel_init();
 
-    neo_thread_init(&thread_one, thread_one_fxn, NULL, (uint8_t *)thread_one_stack, 4 * 40);
-    neo_thread_init(&thread_two, thread_two_fxn, NULL, (uint8_t *)thread_two_stack, 4 * 40);
+    neo_thread_init(&thread_one, thread_one_fxn, NULL, (uint8_t *)thread_one_stack, sizeof(thread_one_stack), NEO_MIN_PRIORITY);
+    neo_thread_init(&thread_two, thread_two_fxn, NULL, (uint8_t *)thread_two_stack, sizeof(thread_two_stack), NEO_MIN_PRIORITY);
 
     void *ptr = neo_alloc(16);
     neo_free(ptr);
@@ -107,6 +114,18 @@ int main(void)
     ptr = neo_alloc(32);
     neo_free(ptr);
 
+#ifdef NEO_PROFILE
+    neo_profile_scheduler();
+    neo_profile_sleep_queue();
+    neo_profile_thread_create();
+    neo_profile_heap();
+    neo_profile_pool();
+    neo_profile_syscall();
+    neo_thread_init(&periodic_thread, neo_profile_periodic, NULL, (uint8_t *)periodic_thread_stack, sizeof(periodic_thread_stack), NEO_MAX_PRIORITY);
+    neo_thread_set_privileged(&periodic_thread, true); // it reads DWT->CYCCNT and SysTick, which are privileged only
+    neo_thread_start(&periodic_thread);
+#endif
+
     neo_thread_start(&thread_one);
     neo_thread_start(&thread_two);
 
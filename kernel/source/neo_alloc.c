@@ -1,207 +1,382 @@
 #include "neo_alloc.h"
+#include "neo_syscall.h"
+#include "neo_profile.h"
 #include "core_cm4.h"
+#include "neo_critical.h"
 
-// Declare _heap_start as a pointer to the start of the heap region
+// Bounds of the heap region; the linker script gives it all the SRAM between .bss and the main stack
 extern uint8_t _heap_start[];
+extern uint8_t _heap_end[];
 
 /**
  * Configuration constants for the heap allocator
  */
-#define HEAP_SIZE 0x400  // 1KB total heap size
-#define SPLIT_CUTOFF 16  // Minimum remaining size needed to split a chunk into two
-#define DEFRAG_CUTOFF 10 // Number of free operations before automatic defragmentation
+#define SPLIT_CUTOFF 16 // Minimum remaining size needed to split a chunk into two
+
+/**
+ * Two-Level Segregated Fit (TLSF) index constants
+ * Free chunks are kept in size classes: the first level splits sizes by powers of two, the second level splits each
+ * power of two into SL_INDEX_COUNT equal ranges. Sizes below SMALL_CHUNK_SIZE all go to first-level class 0, which
+ * the second level splits into ranges of 4 bytes, one per aligned size
+ * A bitmap per level records which classes have free chunks, so finding a class is one CLZ on each level
+ */
+#define ALIGN_LOG2 2                                // chunk sizes are multiples of 4 bytes
+#define SL_INDEX_LOG2 3                             // 8 second-level classes per power of two
+#define SL_INDEX_COUNT (1U << SL_INDEX_LOG2)
+#define FL_INDEX_SHIFT (SL_INDEX_LOG2 + ALIGN_LOG2) // log2 of SMALL_CHUNK_SIZE
+#define SMALL_CHUNK_SIZE (1U << FL_INDEX_SHIFT)
+#define FL_INDEX_MAX 16                             // highest bit of a chunk size; covers the 96 KB of SRAM
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 2)
+#define MAX_CHUNK_SIZE ((2U << FL_INDEX_MAX) - (1U << ALIGN_LOG2)) // largest size the classes can file
+
+_Static_assert(SL_INDEX_COUNT <= 32U && FL_INDEX_COUNT <= 32U, "each level's classes must fit in a 32-bit bitmap");
 
 /**
  * Chunk header structure (4 bytes total)
- * The fields are arranged for optimal memory alignment:
- * - allocated: Indicates if chunk is in use (1 byte)
- * - padding: Reserved for future use (1 byte)
- * - size: Size of the chunk's data area in bytes (2 bytes)
+ * The fields share one 32-bit word:
+ * - allocated: Indicates if chunk is in use (1 bit)
+ * - prev_allocated: Indicates if the chunk physically before it is in use (1 bit)
+ * - size: Size of the chunk's data area in bytes (30 bits)
  *
- * This arrangement ensures the size field is 2-byte aligned, which is
- * important for efficient access on ARM processors. The total header
- * remains 4 bytes to maintain alignment of the data portion.
+ * Small and large chunks alike carry a single word of overhead, and sizes
+ * are no longer limited to 64 KB. The header is 4 bytes to maintain
+ * alignment of the data portion; every chunk starts on a 4-byte boundary,
+ * which lets a header be viewed as a FreeChunk.
  */
 typedef struct
 {
-    uint8_t allocated; // 0 = free, 1 = allocated
-    uint8_t padding;   // Unused, helps with alignment
-    uint16_t size;     // Size of chunk data (excluding header)
-} __attribute__((packed)) ChunkHeader;
+    uint32_t allocated : 1;      // 0 = free, 1 = allocated
+    uint32_t prev_allocated : 1; // 0 = the previous chunk is free and has a footer, 1 = allocated or no previous chunk
+    uint32_t size : 30;          // Size of chunk data (excluding header)
+} ChunkHeader;
+
+_Static_assert(sizeof(ChunkHeader) == 4U, "the header must stay one word");
+
+/**
+ * Free chunk structure
+ * A free chunk links into the list of its size class through its data area; the lists are doubly linked so that a
+ * chunk can be taken out of the middle in constant time
+ * The last word of a free chunk's data area is its footer (boundary tag), which points back at its header; together
+ * with prev_allocated in the next chunk's header, it lets a chunk being freed find a free chunk before it without
+ * walking the heap. No chunk is smaller than MIN_CHUNK_SIZE, so the links and the footer always fit
+ */
+typedef struct FreeChunk
+{
+    ChunkHeader header;
+    struct FreeChunk *next_free; // next free chunk of the same size class
+    struct FreeChunk *prev_free; // previous free chunk of the same size class; NULL for the list head
+} FreeChunk;
+
+#define MIN_CHUNK_SIZE (sizeof(FreeChunk) - sizeof(ChunkHeader) + sizeof(ChunkHeader *))
+
+_Static_assert(SPLIT_CUTOFF >= MIN_CHUNK_SIZE, "the remainder of a split must be able to hold the free list links and the footer");
 
-// Define the heap region bounds using external symbol
+// Define the heap region bounds; heap_end is set by neo_heap_init
 static uint8_t *const heap_start = &_heap_start[0];
-static uint8_t *const heap_end = &_heap_start[HEAP_SIZE];
+NEO_KERNEL_BSS static uint8_t *heap_end;
 
-// Counter for tracking free operations to trigger defragmentation
-static volatile uint8_t free_calls = 0;
+// Free lists of every size class, and the bitmaps of the non-empty ones
+NEO_KERNEL_BSS static FreeChunk *free_lists[FL_INDEX_COUNT][SL_INDEX_COUNT];
+NEO_KERNEL_BSS static uint32_t fl_bitmap;                 // bit fl is set if any list of first-level class fl is non-empty
+NEO_KERNEL_BSS static uint32_t sl_bitmap[FL_INDEX_COUNT]; // bit sl of sl_bitmap[fl] is set if free_lists[fl][sl] is non-empty
+
+#ifdef NEO_PROFILE
+neo_profile_stat_t neo_bench_alloc;
+neo_profile_stat_t neo_bench_free;
+uint32_t neo_bench_alloc_failed;
+neo_profile_stat_t neo_bench_first_fit_alloc;
+neo_profile_stat_t neo_bench_first_fit_free;
+uint32_t neo_bench_first_fit_alloc_failed;
+#endif
 
 /**
  * Validates if a chunk header pointer is within the heap bounds
- * and properly aligned.
+ * and properly aligned, and if the chunk's size keeps it within them.
+ *
+ * Headers, free list links and footers all live in the heap, where unprivileged threads can write, so every chunk
+ * reached through one of them is checked with this before the allocator writes to it or files it; a chunk that passes
+ * lies whole inside the heap, so a corrupted heap can only ever make the allocator write the heap itself.
  *
  * @param header Pointer to the chunk header to validate
  * @return true if header is valid, false otherwise
  */
 static bool is_valid_header(const ChunkHeader *header)
 {
-    return ((uint8_t *)header >= heap_start &&
-            (uint8_t *)header + sizeof(ChunkHeader) <= heap_end);
+    uint8_t *start = (uint8_t *)header;
+    return (start >= heap_start && start < heap_end && !((uintptr_t)start & 3U) &&
+            header->size >= MIN_CHUNK_SIZE && !(header->size & 3U) &&
+            header->size <= (uint32_t)(heap_end - start) - sizeof(ChunkHeader));
 }
 
 /**
- * Retrieves a chunk header at a given offset in the heap.
+ * Retrieves the chunk that physically follows a chunk in the heap.
  *
- * @param offset Byte offset from heap start
- * @return Pointer to chunk header, or NULL if offset is invalid
+ * @param chunk Pointer to the chunk header
+ * @return Pointer to the next chunk header, or NULL if chunk is the last one
  */
-static ChunkHeader *get_header(size_t offset)
+static ChunkHeader *next_chunk(const ChunkHeader *chunk)
 {
-    if (offset >= HEAP_SIZE - sizeof(ChunkHeader))
-        return NULL;
-    return (ChunkHeader *)(heap_start + offset);
+    uint8_t *next = (uint8_t *)chunk + sizeof(ChunkHeader) + chunk->size;
+    return next < heap_end ? (ChunkHeader *)next : NULL;
+}
+
+/**
+ * Retrieves the free chunk that physically precedes a chunk, through its footer.
+ *
+ * @param chunk Pointer to a chunk header whose prev_allocated is 0
+ * @return Pointer to the previous chunk header
+ */
+static ChunkHeader *prev_chunk(const ChunkHeader *chunk)
+{
+    return ((ChunkHeader *const *)chunk)[-1];
 }
 
 /**
- * Coalesces adjacent free chunks to reduce memory fragmentation.
- * This function merges consecutive unallocated chunks into larger
- * free chunks, improving allocation efficiency for larger requests.
+ * Writes the footer of a free chunk and tells the next chunk that it follows a free one.
  *
- * The process:
- * 1. Scans the heap from start to end
- * 2. When finding a free chunk, checks if the next chunk is also free
- * 3. If both chunks are free, merges them by updating the first chunk's size
- * 4. Continues until no more merges are possible
+ * @param chunk Pointer to the free chunk header
  */
-static void defragment(void)
+static void set_free_tags(ChunkHeader *chunk)
 {
-    size_t curr_offset = 0;
+    ChunkHeader **footer = (ChunkHeader **)((uint8_t *)chunk + sizeof(ChunkHeader) + chunk->size) - 1;
+    *footer = chunk;
 
-    while (curr_offset < HEAP_SIZE)
+    ChunkHeader *next = next_chunk(chunk);
+    if (next)
     {
-        ChunkHeader *curr = get_header(curr_offset);
-        if (!curr)
-            break;
+        next->prev_allocated = 0;
+    }
+}
 
-        if (!curr->allocated)
-        {
-            size_t next_offset = curr_offset + sizeof(ChunkHeader) + curr->size;
-            ChunkHeader *next = get_header(next_offset);
+/**
+ * Computes the size class a chunk of the given size is filed under.
+ *
+ * @param size Chunk data size in bytes
+ * @param fl Receives the first-level index
+ * @param sl Receives the second-level index
+ */
+static void mapping(uint32_t size, uint32_t *fl, uint32_t *sl)
+{
+    if (size < SMALL_CHUNK_SIZE)
+    {
+        *fl = 0;
+        *sl = size >> ALIGN_LOG2;
+    }
+    else
+    {
+        uint32_t bit = (uint32_t)neo_most_sig_one(size);
+        *sl = (size >> (bit - SL_INDEX_LOG2)) ^ SL_INDEX_COUNT; // the SL_INDEX_LOG2 bits below the top one
+        *fl = bit - FL_INDEX_SHIFT + 1U;
+    }
+}
 
-            if (next && !next->allocated)
-            {
-                // Merge with next chunk by absorbing its space
-                curr->size += sizeof(ChunkHeader) + next->size;
-                continue; // Recheck the merged chunk for more possible merges
-            }
+/**
+ * Links a free chunk into the list of its size class.
+ *
+ * @param chunk Pointer to the free chunk
+ */
+static void insert_free_chunk(FreeChunk *chunk)
+{
+    uint32_t fl, sl;
+    mapping(chunk->header.size, &fl, &sl);
+
+    chunk->prev_free = NULL;
+    chunk->next_free = free_lists[fl][sl];
+    if (chunk->next_free)
+    {
+        chunk->next_free->prev_free = chunk;
+    }
+    free_lists[fl][sl] = chunk;
+    fl_bitmap |= 1U << fl;
+    sl_bitmap[fl] |= 1U << sl;
+}
+
+/**
+ * Unlinks a free chunk from the list of its size class.
+ *
+ * @param chunk Pointer to the free chunk
+ */
+static void remove_free_chunk(FreeChunk *chunk)
+{
+    uint32_t fl, sl;
+    mapping(chunk->header.size, &fl, &sl);
+
+    // a link that isn't a valid chunk ends the list there
+    FreeChunk *next = chunk->next_free && is_valid_header(&chunk->next_free->header) ? chunk->next_free : NULL;
+    FreeChunk *prev = chunk->prev_free && is_valid_header(&chunk->prev_free->header) ? chunk->prev_free : NULL;
+
+    if (next)
+    {
+        next->prev_free = prev;
+    }
+    if (prev)
+    {
+        prev->next_free = next;
+        return;
+    }
+
+    free_lists[fl][sl] = next;
+    if (!free_lists[fl][sl])
+    {
+        sl_bitmap[fl] &= ~(1U << sl);
+        if (!sl_bitmap[fl])
+        {
+            fl_bitmap &= ~(1U << fl);
         }
+    }
+}
 
-        curr_offset += sizeof(ChunkHeader) + curr->size;
+/**
+ * Finds a free chunk of at least the given size in constant time.
+ *
+ * The search:
+ * 1. Rounds the size up to the next class boundary, so every chunk of the class found is large enough
+ * 2. Looks for a non-empty class at or above it within the same first-level class (one CLZ)
+ * 3. Failing that, takes the smallest non-empty first-level class above it (one CLZ each level)
+ * 4. Failing that too, checks only the first chunk of the size's own class, which may still be large enough
+ *
+ * @param size Required data size in bytes
+ * @return Pointer to a suitable free chunk, or NULL if there is none
+ */
+static FreeChunk *find_free_chunk(uint32_t size)
+{
+    uint32_t fl, sl;
+    uint32_t rounded = size;
+    if (size >= SMALL_CHUNK_SIZE)
+    {
+        rounded += (1U << ((uint32_t)neo_most_sig_one(size) - SL_INDEX_LOG2)) - 1U;
+    }
+
+    mapping(rounded, &fl, &sl);
+    if (fl < FL_INDEX_COUNT)
+    {
+        uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+        if (!sl_map)
+        {
+            uint32_t fl_map = neo_bits_above(fl_bitmap, fl);
+            fl = neo_least_sig_one(fl_map);
+            sl_map = fl_map ? sl_bitmap[fl] : 0U;
+        }
+        if (sl_map)
+        {
+            return free_lists[fl][neo_least_sig_one(sl_map)];
+        }
     }
+
+    // the classes above hold nothing; without this, the last chunk of a nearly full heap could never be handed out whole
+    mapping(size, &fl, &sl);
+    FreeChunk *chunk = fl < FL_INDEX_COUNT ? free_lists[fl][sl] : NULL;
+    return chunk && chunk->header.size >= size ? chunk : NULL;
 }
 
 /**
  * Initializes the heap by creating a single large free chunk.
- * This must be called before any allocation operations.
+ * This must be called before any allocation operations, with the kernel locked; neo_kernel_init does it.
+ * It doesn't take the lock itself, since kernel critical sections don't nest.
  *
  * The function:
- * 1. Disables interrupts to ensure thread safety
- * 2. Creates an initial free chunk spanning the entire heap
- * 3. Re-enables interrupts
+ * 1. Sizes the heap from the linker symbols, leaving out anything a single chunk can't cover
+ * 2. Creates an initial free chunk spanning the entire heap and files it in its size class
  */
 void neo_heap_init(void)
 {
-    __disable_irq();
-    ChunkHeader *initial = (ChunkHeader *)heap_start;
-    initial->allocated = 0;
-    initial->padding = 0;
-    initial->size = HEAP_SIZE - sizeof(ChunkHeader);
-    __enable_irq();
+    uint32_t heap_size = ((uintptr_t)_heap_end - (uintptr_t)heap_start) & ~((1U << ALIGN_LOG2) - 1U);
+    if (heap_size > MAX_CHUNK_SIZE + sizeof(ChunkHeader))
+    {
+        heap_size = MAX_CHUNK_SIZE + sizeof(ChunkHeader);
+    }
+    heap_end = heap_start + heap_size;
+
+    FreeChunk *initial = (FreeChunk *)heap_start;
+    initial->header.allocated = 0;
+    initial->header.prev_allocated = 1; // nothing before it to merge with
+    initial->header.size = heap_size - sizeof(ChunkHeader);
+    set_free_tags(&initial->header);
+    insert_free_chunk(initial);
 }
 
 /**
  * Allocates memory from the heap with proper alignment.
+ * Runs in constant time, whatever the number of chunks in the heap.
  *
  * The allocation process:
- * 1. Rounds requested size up to maintain 4-byte alignment
- * 2. Searches for first free chunk large enough to hold request
- * 3. If chunk is significantly larger than needed, splits it
- * 4. Returns pointer to the allocated memory region
+ * 1. Rounds requested size up to maintain 4-byte alignment, and to the size of the free list links
+ * 2. Takes a free chunk from the smallest size class that is guaranteed to hold the request
+ * 3. If chunk is significantly larger than needed, splits it and files the remainder as a free chunk
+ * 4. Otherwise tells the next chunk that the one before it is now in use
+ * 5. Returns pointer to the allocated memory region
  *
  * @param size Requested allocation size in bytes
  * @return Pointer to allocated memory, or NULL if allocation fails
  */
-void *neo_alloc(uint16_t size)
+void *neo_sys_alloc(uint32_t size)
 {
-    if (size == 0)
+    if (size == 0 || size > MAX_CHUNK_SIZE)
         return NULL;
 
-    __disable_irq();
-
     // Round size up to nearest multiple of 4 for alignment
-    uint16_t aligned_size = (size + 3) & ~3;
+    uint32_t aligned_size = (size + 3U) & ~3U;
+    if (aligned_size < MIN_CHUNK_SIZE)
+    {
+        aligned_size = MIN_CHUNK_SIZE;
+    }
 
-    size_t curr_offset = 0;
-    while (curr_offset < HEAP_SIZE)
+    neo_kernel_lock();
+
+    FreeChunk *chunk = find_free_chunk(aligned_size);
+    if (!chunk || !is_valid_header(&chunk->header) || chunk->header.size < aligned_size)
     {
-        ChunkHeader *curr = get_header(curr_offset);
-        if (!curr)
-            break;
+        neo_kernel_unlock();
+        return NULL;
+    }
+    remove_free_chunk(chunk);
 
-        if (!curr->allocated && curr->size >= aligned_size)
-        {
-            // Check if chunk should be split to avoid wasting space
-            if (curr->size >= aligned_size + sizeof(ChunkHeader) + SPLIT_CUTOFF)
-            {
-                size_t new_offset = curr_offset + sizeof(ChunkHeader) + aligned_size;
-                ChunkHeader *new_chunk = get_header(new_offset);
-
-                if (new_chunk)
-                {
-                    // Initialize the new chunk from the split
-                    new_chunk->allocated = 0;
-                    new_chunk->padding = 0;
-                    new_chunk->size = curr->size - aligned_size - sizeof(ChunkHeader);
-
-                    // Update current chunk
-                    curr->allocated = 1;
-                    curr->size = aligned_size;
-                }
-            }
-            else
-            {
-                // Use entire chunk if splitting would create too small a remainder
-                curr->allocated = 1;
-            }
+    // Check if chunk should be split to avoid wasting space
+    if (chunk->header.size >= aligned_size + sizeof(ChunkHeader) + SPLIT_CUTOFF)
+    {
+        // Initialize the new chunk from the split
+        FreeChunk *new_chunk = (FreeChunk *)((uint8_t *)chunk + sizeof(ChunkHeader) + aligned_size);
+        new_chunk->header.allocated = 0;
+        new_chunk->header.prev_allocated = 1;
+        new_chunk->header.size = chunk->header.size - aligned_size - sizeof(ChunkHeader);
+        set_free_tags(&new_chunk->header); // the next chunk still follows a free one
+        insert_free_chunk(new_chunk);
 
-            __enable_irq();
-            return heap_start + curr_offset + sizeof(ChunkHeader);
+        chunk->header.size = aligned_size;
+    }
+    else
+    {
+        ChunkHeader *next = next_chunk(&chunk->header);
+        if (next)
+        {
+            next->prev_allocated = 1;
         }
-
-        curr_offset += sizeof(ChunkHeader) + curr->size;
     }
+    chunk->header.allocated = 1;
 
-    __enable_irq();
-    return NULL;
+    neo_kernel_unlock();
+    return (uint8_t *)chunk + sizeof(ChunkHeader);
 }
 
 /**
- * Frees previously allocated memory and potentially defragments the heap.
+ * Frees previously allocated memory, merging it with its free neighbours right away.
+ * Runs in constant time: two free chunks are never adjacent, so there is at most one neighbour on each side to merge.
  *
  * The free process:
  * 1. Validates the provided pointer
- * 2. Marks the chunk as unallocated
- * 3. Increments free counter and triggers defragmentation if threshold reached
+ * 2. If the next chunk is free, takes it out of its free list and absorbs it
+ * 3. If the previous chunk is free (found through its footer), takes it out of its free list and grows it instead
+ * 4. Writes the footer of the merged chunk and files it in its size class
  *
  * @param ptr Pointer to memory region to free
  */
-void neo_free(void *ptr)
+void neo_sys_free(void *ptr)
 {
-    __disable_irq();
+    neo_kernel_lock();
 
-    if (!ptr || (uint8_t *)ptr < heap_start || (uint8_t *)ptr >= heap_end)
+    if (!ptr || (uint8_t *)ptr < heap_start + sizeof(ChunkHeader) || (uint8_t *)ptr >= heap_end)
     {
-        __enable_irq();
+        neo_kernel_unlock();
         return;
     }
 
@@ -210,18 +385,219 @@ void neo_free(void *ptr)
 
     if (!is_valid_header(header) || !header->allocated)
     {
-        __enable_irq();
+        neo_kernel_unlock();
         return;
     }
 
     header->allocated = 0;
 
-    // Trigger defragmentation periodically to prevent excessive fragmentation
-    if (++free_calls >= DEFRAG_CUTOFF)
+    ChunkHeader *next = next_chunk(header);
+    if (next && !next->allocated && is_valid_header(next))
+    {
+        // Merge with next chunk by absorbing its space
+        remove_free_chunk((FreeChunk *)next);
+        header->size += sizeof(ChunkHeader) + next->size;
+    }
+
+    ChunkHeader *prev = header->prev_allocated ? NULL : prev_chunk(header);
+    if (prev && is_valid_header(prev) && !prev->allocated && next_chunk(prev) == header)
+    {
+        // Merge into the previous chunk, which absorbs this one's space
+        remove_free_chunk((FreeChunk *)prev);
+        prev->size += sizeof(ChunkHeader) + header->size;
+        header = prev;
+    }
+
+    set_free_tags(header);
+    insert_free_chunk((FreeChunk *)header);
+
+    neo_kernel_unlock();
+}
+
+/* Unprivileged threads can't lock the kernel to protect the heap, so they allocate and free through SVC */
+
+void *neo_alloc(uint32_t size)
+{
+    if (neo_in_privileged_context())
+    {
+        return neo_sys_alloc(size);
+    }
+    return (void *)neo_syscall(NEO_SYS_ALLOC, size, 0, 0, 0);
+}
+
+void neo_free(void *ptr)
+{
+    if (neo_in_privileged_context())
+    {
+        neo_sys_free(ptr);
+        return;
+    }
+    neo_syscall(NEO_SYS_FREE, (uint32_t)ptr, 0, 0, 0);
+}
+
+#ifdef NEO_PROFILE
+
+#define HEAP_BENCH_SLOTS (16U)   // blocks held at once
+#define HEAP_BENCH_OPS (4000U)   // allocations and frees in the trace
+#define HEAP_BENCH_MAX_SIZE (96U)
+
+/**
+ * The first-fit allocator the heap had before TLSF, kept only so that neo_profile_heap can run it over the same trace
+ * Allocation walks the chunks from the start of its arena for the first free one that is large enough; freeing only
+ * marks the chunk, and every FIRST_FIT_DEFRAG_CUTOFF frees a walk over the whole arena merges neighbouring free chunks
+ * It has an arena of its own, large enough that the trace never runs it out of memory
+ */
+#define FIRST_FIT_HEAP_SIZE (0x1000U)
+#define FIRST_FIT_SPLIT_CUTOFF 16
+#define FIRST_FIT_DEFRAG_CUTOFF 10
+
+typedef struct
+{
+    uint8_t allocated; // 0 = free, 1 = allocated
+    uint8_t padding;
+    uint16_t size; // Size of chunk data (excluding header)
+} FirstFitHeader;
+
+static uint32_t first_fit_heap[FIRST_FIT_HEAP_SIZE / 4U];
+static uint8_t first_fit_free_calls;
+
+// chunk header at a byte offset in the arena, or NULL if there's no room for one there
+static FirstFitHeader *first_fit_header(uint32_t offset)
+{
+    if (offset >= FIRST_FIT_HEAP_SIZE - sizeof(FirstFitHeader))
+        return NULL;
+    return (FirstFitHeader *)((uint8_t *)first_fit_heap + offset);
+}
+
+// merges every run of neighbouring free chunks in the arena
+static void first_fit_defragment(void)
+{
+    uint32_t curr_offset = 0;
+    FirstFitHeader *curr;
+    while ((curr = first_fit_header(curr_offset)))
+    {
+        FirstFitHeader *next = first_fit_header(curr_offset + sizeof(FirstFitHeader) + curr->size);
+        if (!curr->allocated && next && !next->allocated)
+        {
+            curr->size += sizeof(FirstFitHeader) + next->size;
+            continue; // the merged chunk may merge with the one after it too
+        }
+        curr_offset += sizeof(FirstFitHeader) + curr->size;
+    }
+}
+
+static void first_fit_init(void)
+{
+    FirstFitHeader *initial = first_fit_header(0);
+    initial->allocated = 0;
+    initial->padding = 0;
+    initial->size = FIRST_FIT_HEAP_SIZE - sizeof(FirstFitHeader);
+    first_fit_free_calls = 0;
+}
+
+static void *first_fit_alloc(uint32_t size)
+{
+    uint32_t aligned_size = (size + 3U) & ~3U;
+
+    neo_kernel_lock();
+    uint32_t curr_offset = 0;
+    FirstFitHeader *curr;
+    while ((curr = first_fit_header(curr_offset)))
+    {
+        if (!curr->allocated && curr->size >= aligned_size)
+        {
+            if (curr->size >= aligned_size + sizeof(FirstFitHeader) + FIRST_FIT_SPLIT_CUTOFF)
+            {
+                FirstFitHeader *new_chunk = first_fit_header(curr_offset + sizeof(FirstFitHeader) + aligned_size);
+                new_chunk->allocated = 0;
+                new_chunk->padding = 0;
+                new_chunk->size = curr->size - aligned_size - sizeof(FirstFitHeader);
+                curr->size = aligned_size;
+            }
+            curr->allocated = 1;
+            neo_kernel_unlock();
+            return (uint8_t *)curr + sizeof(FirstFitHeader);
+        }
+        curr_offset += sizeof(FirstFitHeader) + curr->size;
+    }
+    neo_kernel_unlock();
+    return NULL;
+}
+
+static void first_fit_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    neo_kernel_lock();
+    ((FirstFitHeader *)((uint8_t *)ptr - sizeof(FirstFitHeader)))->allocated = 0;
+    if (++first_fit_free_calls >= FIRST_FIT_DEFRAG_CUTOFF)
+    {
+        first_fit_defragment();
+        first_fit_free_calls = 0;
+    }
+    neo_kernel_unlock();
+}
+
+// xorshift32; a fixed seed gives the same trace on every run, so builds can be compared
+static uint32_t heap_bench_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// runs the trace against one allocator; everything is freed again at the end
+static void heap_bench_run(void *(*alloc)(uint32_t), void (*release)(void *), neo_profile_stat_t *alloc_stat,
+                           neo_profile_stat_t *free_stat, uint32_t *alloc_failed)
+{
+    void *blocks[HEAP_BENCH_SLOTS] = {NULL};
+    uint32_t state = 0x2545F491U;
+
+    for (uint32_t op = 0; op < HEAP_BENCH_OPS; op++)
     {
-        defragment();
-        free_calls = 0;
+        uint32_t slot = heap_bench_random(&state) % HEAP_BENCH_SLOTS;
+        if (blocks[slot])
+        {
+            NEO_PROFILE_START(free_start);
+            release(blocks[slot]);
+            NEO_PROFILE_END(*free_stat, free_start);
+            blocks[slot] = NULL;
+            continue;
+        }
+
+        uint32_t size = heap_bench_random(&state) % HEAP_BENCH_MAX_SIZE + 1U;
+        NEO_PROFILE_START(alloc_start);
+        blocks[slot] = alloc(size);
+        NEO_PROFILE_END(*alloc_stat, alloc_start);
+        if (!blocks[slot])
+        {
+            (*alloc_failed)++;
+        }
+    }
+
+    for (uint32_t slot = 0; slot < HEAP_BENCH_SLOTS; slot++)
+    {
+        release(blocks[slot]);
     }
+}
+
+/**
+ * @brief Time neo_alloc and neo_free over a randomized trace, side by side with the first-fit allocator they replaced
+ * Each step picks one of HEAP_BENCH_SLOTS slots at random and frees its block, or allocates a block of 1 to
+ * HEAP_BENCH_MAX_SIZE bytes into it if it's empty; the worst case is in the max of neo_bench_alloc and neo_bench_free,
+ * and allocations the heap couldn't satisfy are counted in neo_bench_alloc_failed
+ * The same trace then runs against the first-fit allocator, into neo_bench_first_fit_alloc/free/alloc_failed
+ * Call it from main after neo_kernel_init; everything is freed again at the end
+ */
+void neo_profile_heap(void)
+{
+    heap_bench_run(neo_sys_alloc, neo_sys_free, &neo_bench_alloc, &neo_bench_free, &neo_bench_alloc_failed);
+
+    first_fit_init();
+    heap_bench_run(first_fit_alloc, first_fit_free, &neo_bench_first_fit_alloc, &neo_bench_first_fit_free,
+                   &neo_bench_first_fit_alloc_failed);
+}
 
-    __enable_irq();
-}
\ No newline at end of file
+#endif
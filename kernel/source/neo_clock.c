@@ -0,0 +1,244 @@
+#include "neo_clock.h"
+#include "neo_kernel.h"
+#include "neo_syscall.h"
+#include "neo_profile.h"
+#include <stddef.h>
+
+#define COUNTER_HZ (1000000U) // one count per microsecond
+
+_Static_assert(NEO_CLOCK_TIMER_HZ % COUNTER_HZ == 0U, "TIM5 has to be clocked at a whole number of MHz");
+_Static_assert(NEO_CLOCK_IRQ_PRIORITY >= NEO_KERNEL_CEILING, "TIM5 calls into the kernel, so it can't be above the kernel ceiling");
+
+NEO_KERNEL_BSS static neo_clock_timer_t *volatile timers_head; // pending timers, earliest deadline first
+NEO_KERNEL_BSS static neo_clock_timer_t sleep_timers[MAX_THREADS]; // one per thread, for neo_thread_sleep_us
+
+#ifdef NEO_PROFILE
+neo_profile_stat_t neo_clock_lateness;
+#endif
+
+// true if deadline a comes before deadline b; right across counter wraparound while they are less than 2^31 us apart
+static inline bool deadline_before(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
+// points compare channel 1 at the deadline; if the counter has already passed it, the match would only come after the
+// counter wraps, so the compare event is generated by hand
+// must be called with the kernel locked
+static void program_compare(uint32_t deadline)
+{
+    TIM5->CCR1 = deadline;
+    TIM5->DIER |= TIM_DIER_CC1IE;
+    if (!deadline_before(TIM5->CNT, deadline))
+    {
+        TIM5->EGR = TIM_EGR_CC1G;
+    }
+}
+
+// must be called with the kernel locked
+static void timer_insert(neo_clock_timer_t *timer, uint32_t deadline)
+{
+    timer->deadline = deadline;
+    neo_clock_timer_t *volatile *link = &timers_head;
+    while (*link && !deadline_before(deadline, (*link)->deadline))
+    {
+        link = &(*link)->next; // behind the timers with the same deadline, so they expire in the order they were started
+    }
+    timer->next = *link;
+    *link = timer;
+    timer->pending = true;
+
+    if (timers_head == timer)
+    {
+        program_compare(deadline);
+    }
+}
+
+// must be called with the kernel locked
+static void timer_remove(neo_clock_timer_t *timer)
+{
+    neo_clock_timer_t *volatile *link = &timers_head;
+    while (*link != timer)
+    {
+        link = &(*link)->next;
+    }
+    *link = timer->next;
+    timer->pending = false; // if it was the earliest, the compare still fires and just finds nothing due
+}
+
+/**
+ * @brief Start TIM5 as the microsecond clocksource
+ * Must be called with the kernel locked, before any timer is started; neo_kernel_init does it
+ */
+void neo_clock_init(void)
+{
+    RCC->APB1ENR |= RCC_APB1ENR_TIM5EN; // a mask, so not SET_BIT, which takes a bit number
+    (void)RCC->APB1ENR;                 // the clock is only on two APB cycles after the write
+
+    TIM5->CR1 = 0;
+    TIM5->PSC = NEO_CLOCK_TIMER_HZ / COUNTER_HZ - 1U;
+    TIM5->ARR = 0xFFFFFFFFU;
+    TIM5->CCMR1 = 0; // channel 1 is a frozen output compare; only its match flag is used
+    TIM5->DIER = 0;
+    TIM5->CNT = 0;
+    TIM5->EGR = TIM_EGR_UG; // load the prescaler now rather than at the first overflow
+    TIM5->SR = 0;
+
+    NVIC_SetPriority(TIM5_IRQn, NEO_CLOCK_IRQ_PRIORITY);
+    NVIC_EnableIRQ(TIM5_IRQn);
+    TIM5->CR1 = TIM_CR1_CEN;
+}
+
+/**
+ * @brief Run a callback once, a given number of microseconds from now
+ * A timer that is already pending is restarted with the new delay and callback
+ * @param timer Pointer to timer structure; it must stay valid until the callback has run or the timer is cancelled
+ * @param delay_us Microseconds from now, at most NEO_CLOCK_MAX_DELAY_US
+ * @param callback Function run from the TIM5 interrupt
+ * @param arg Argument passed to the callback
+ * @return true if the timer was started, false if the caller isn't privileged or an argument is invalid
+ */
+bool neo_clock_timer_start(neo_clock_timer_t *timer, uint32_t delay_us, void (*callback)(void *arg), void *arg)
+{
+    if (!neo_in_privileged_context() || !timer || !callback || delay_us > NEO_CLOCK_MAX_DELAY_US)
+    {
+        return false;
+    }
+
+    neo_kernel_lock();
+    if (timer->pending)
+    {
+        timer_remove(timer);
+    }
+    timer->callback = callback;
+    timer->arg = arg;
+    timer_insert(timer, TIM5->CNT + delay_us);
+    neo_kernel_unlock();
+    return true;
+}
+
+/**
+ * @brief Stop a pending timer before its callback runs
+ * @param timer Pointer to timer structure
+ * @return true if the timer was pending, false if it had already expired, was never started or the caller isn't privileged
+ */
+bool neo_clock_timer_cancel(neo_clock_timer_t *timer)
+{
+    if (!neo_in_privileged_context() || !timer)
+    {
+        return false;
+    }
+
+    neo_kernel_lock();
+    bool was_pending = timer->pending;
+    if (was_pending)
+    {
+        timer_remove(timer);
+    }
+    neo_kernel_unlock();
+    return was_pending;
+}
+
+/**
+ * @brief TIM5 interrupt: runs the callbacks of all the timers that are due and reprograms the compare for the next one
+ * The callbacks run with the kernel unlocked, and may start and cancel timers, including their own
+ */
+void TIM5_handler(void)
+{
+    TIM5->SR = ~TIM_SR_CC1IF; // the flags are cleared by writing zeros
+
+    neo_kernel_lock();
+    while (timers_head && !deadline_before(TIM5->CNT, timers_head->deadline))
+    {
+        neo_clock_timer_t *timer = timers_head;
+        timers_head = timer->next;
+        timer->pending = false;
+        neo_kernel_unlock();
+
+#ifdef NEO_PROFILE
+        neo_profile_record(&neo_clock_lateness, TIM5->CNT - timer->deadline);
+#endif
+        timer->callback(timer->arg);
+        neo_kernel_lock();
+    }
+
+    if (timers_head)
+    {
+        program_compare(timers_head->deadline);
+    }
+    else
+    {
+        TIM5->DIER &= ~TIM_DIER_CC1IE;
+    }
+    neo_kernel_unlock();
+}
+
+// callback of the sleep timers; arg is the sleeping thread's id
+static void wake_sleeper(void *arg)
+{
+    uint32_t index = (uint32_t)arg;
+    neo_kernel_lock();
+    if (neo_kernel_is_waiting_for(index, &sleep_timers[index]))
+    {
+        neo_kernel_wake(index);
+    }
+    neo_kernel_unlock();
+}
+
+/**
+ * @brief Kernel side of neo_thread_sleep_us; blocks the calling thread until its sleep timer fires
+ * A sleep longer than NEO_CLOCK_MAX_DELAY_US would sort into the past, so it returns right away instead
+ */
+void neo_sys_thread_sleep_us(uint32_t us)
+{
+    if (us > NEO_CLOCK_MAX_DELAY_US)
+    {
+        return;
+    }
+
+    neo_kernel_lock();
+    uint32_t index = neo_kernel_current_thread();
+    sleep_timers[index].callback = wake_sleeper;
+    sleep_timers[index].arg = (void *)index;
+    timer_insert(&sleep_timers[index], TIM5->CNT + us);
+    neo_kernel_block_current_on(&sleep_timers[index], NEO_WAIT_FOREVER);
+    neo_kernel_unlock();
+}
+
+// blocks the calling thread for at most NEO_CLOCK_MAX_DELAY_US
+static void sleep_us_blocking(uint32_t us)
+{
+    if (neo_in_privileged_context())
+    {
+        neo_sys_thread_sleep_us(us);
+        return;
+    }
+    neo_syscall(NEO_SYS_THREAD_SLEEP_US, us, 0, 0, 0);
+}
+
+/**
+ * @brief Sleep for a number of microseconds
+ * Unlike neo_thread_sleep, the wakeup comes from a TIM5 compare match at the exact microsecond rather than on a tick,
+ * so it's only late by the interrupt and context switch latency. Sleeps up to NEO_CLOCK_SPIN_US, and any sleep outside
+ * a running thread (from main before the scheduler starts or from a handler), busy-wait instead
+ * A sleep longer than NEO_CLOCK_MAX_DELAY_US is taken in two halves, each short enough for the clock
+ * @param us Microseconds to sleep
+ */
+void neo_thread_sleep_us(uint32_t us)
+{
+    uint32_t start = TIM5->CNT;
+    if (us <= NEO_CLOCK_SPIN_US || !neo_kernel_in_thread())
+    {
+        while (TIM5->CNT - start < us)
+        {
+        }
+        return;
+    }
+
+    if (us > NEO_CLOCK_MAX_DELAY_US)
+    {
+        sleep_us_blocking(us / 2U);
+        us -= us / 2U;
+    }
+    sleep_us_blocking(us);
+}
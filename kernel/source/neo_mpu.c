@@ -0,0 +1,121 @@
+#include "neo_mpu.h"
+#include <stddef.h>
+
+/* Static regions; the sizes match the memory regions in linker_script.ld */
+#define FLASH_REGION (0U)
+#define SRAM_REGION (1U)
+#define PERIPH_REGION (2U)
+#define KERNEL_RAM_REGION (3U) // above the SRAM region, so it wins where they overlap
+#define MSP_GUARD_REGION (5U)  // above the kernel RAM region
+
+// bounds of kernel RAM; a power of two in size, aligned to it
+extern uint8_t _kernel_ram_start[];
+extern uint8_t _kernel_ram_end[];
+extern uint8_t _stack_start[]; // bottom of the main stack
+
+// 96 KB of SRAM is covered by a 128 KB region with its top two 16 KB subregions disabled
+#define SRAM_DISABLED_SUBREGIONS (0xC0U)
+
+// ARM_MPU_RASR_EX in the vendored mpu_armv7.h drops its SubRegionDisable and Size arguments and never sets ENABLE
+#define REGION_RASR(disable_exec, access_permission, access_attributes, subregion_disable, size)        \
+    (ARM_MPU_RASR_EX(disable_exec, access_permission, access_attributes, 0U, 0U) |                     \
+     (((uint32_t)(subregion_disable) << MPU_RASR_SRD_Pos) & MPU_RASR_SRD_Msk) |                        \
+     (((uint32_t)(size) << MPU_RASR_SIZE_Pos) & MPU_RASR_SIZE_Msk) | MPU_RASR_ENABLE_Msk)
+
+/**
+ * @brief Configure the static MPU regions and enable the MPU
+ * The guard region stays disabled until the first context switch loads one from a TCB
+ * Must be called with interrupts disabled, before any thread runs
+ */
+void neo_mpu_init(void)
+{
+    ARM_MPU_Disable();
+
+    // flash: code and constants, read-only for everyone
+    ARM_MPU_SetRegion(ARM_MPU_RBAR(FLASH_REGION, FLASH_BASE),
+                      REGION_RASR(0U, ARM_MPU_AP_RO, ARM_MPU_ACCESS_(0U, 0U, 1U, 0U), 0U, ARM_MPU_REGION_SIZE_512KB));
+
+    // SRAM: data, heap and thread stacks; never executable
+    ARM_MPU_SetRegion(ARM_MPU_RBAR(SRAM_REGION, SRAM_BASE),
+                      REGION_RASR(1U, ARM_MPU_AP_FULL, ARM_MPU_ACCESS_(0U, 1U, 1U, 0U), SRAM_DISABLED_SUBREGIONS, ARM_MPU_REGION_SIZE_128KB));
+
+    // peripherals, so that unprivileged threads can keep driving GPIOs and the like
+    ARM_MPU_SetRegion(ARM_MPU_RBAR(PERIPH_REGION, PERIPH_BASE),
+                      REGION_RASR(1U, ARM_MPU_AP_FULL, ARM_MPU_ACCESS_DEVICE(1U), 0U, ARM_MPU_REGION_SIZE_512MB));
+
+    // kernel RAM: read-only for unprivileged threads; the SIZE field is log2 of the size minus one
+    uint32_t kernel_ram_size = (uint32_t)(_kernel_ram_end - _kernel_ram_start);
+    ARM_MPU_SetRegion(ARM_MPU_RBAR(KERNEL_RAM_REGION, (uint32_t)_kernel_ram_start),
+                      REGION_RASR(1U, ARM_MPU_AP_URO, ARM_MPU_ACCESS_(0U, 1U, 1U, 0U), 0U, 30U - __CLZ(kernel_ram_size)));
+
+    // bottom of the main stack: no access for anyone, so a handler that runs out of main stack faults there
+    ARM_MPU_SetRegion(ARM_MPU_RBAR(MSP_GUARD_REGION, (uint32_t)_stack_start),
+                      REGION_RASR(1U, ARM_MPU_AP_NONE, ARM_MPU_ACCESS_(0U, 0U, 0U, 0U), 0U, ARM_MPU_REGION_SIZE_32B));
+
+    ARM_MPU_ClrRegion(NEO_MPU_GUARD_REGION);
+
+    ARM_MPU_Enable(MPU_CTRL_PRIVDEFENA_Msk); // also enables the MemManage fault
+}
+
+/**
+ * @brief Compute the guard region at the bottom of a thread stack
+ * The guard sits at the first NEO_MPU_GUARD_SIZE aligned address in the stack; declare the stack with
+ * NEO_THREAD_STACK so that it starts there and the guard wastes nothing
+ * @param stack Pointer to the thread's stack memory
+ * @param stack_size Size of stack in bytes
+ * @param guard Filled with the RBAR and RASR values of the guard region
+ * @return The lowest address the thread can use, just above the guard, or NULL if the guard doesn't fit
+ */
+uint8_t *neo_mpu_stack_guard(uint8_t *stack, uint32_t stack_size, ARM_MPU_Region_t *guard)
+{
+    uintptr_t guard_base = ((uintptr_t)stack + NEO_MPU_GUARD_SIZE - 1U) & ~(uintptr_t)(NEO_MPU_GUARD_SIZE - 1U);
+    if (guard_base + NEO_MPU_GUARD_SIZE > (uintptr_t)stack + stack_size)
+    {
+        return NULL;
+    }
+
+    guard->RBAR = ARM_MPU_RBAR(NEO_MPU_GUARD_REGION, guard_base);
+    guard->RASR = REGION_RASR(1U, ARM_MPU_AP_NONE, ARM_MPU_ACCESS_(0U, 0U, 0U, 0U), 0U, ARM_MPU_REGION_SIZE_32B);
+    return (uint8_t *)(guard_base + NEO_MPU_GUARD_SIZE);
+}
+
+/**
+ * @brief Check whether a block of memory lies entirely in kernel RAM
+ * @param address Start of the block
+ * @param size Size of the block in bytes
+ * @return true if the whole block is in kernel RAM
+ */
+bool neo_mpu_in_kernel_ram(const void *address, uint32_t size)
+{
+    uintptr_t start = (uintptr_t)address;
+    return start >= (uintptr_t)_kernel_ram_start && start <= (uintptr_t)_kernel_ram_end && size <= (uintptr_t)_kernel_ram_end - start;
+}
+
+/**
+ * @brief Check whether the kernel may write a block of memory on behalf of the caller of the current syscall
+ * An unprivileged thread in SVC may only pass memory it could write itself: SRAM below kernel RAM, outside its stack
+ * guard. Privileged threads and handlers call the kernel directly and are trusted with any address
+ * @param address Start of the block
+ * @param size Size of the block in bytes
+ * @return true if the kernel may read and write the whole block for the caller
+ */
+bool neo_mpu_caller_can_write(const void *address, uint32_t size)
+{
+    // CONTROL.nPRIV is the privilege of thread mode, so in SVC it is the caller's
+    if (__get_IPSR() != (uint32_t)(SVCall_IRQn + 16) || !(__get_CONTROL() & CONTROL_nPRIV_Msk))
+    {
+        return true;
+    }
+
+    uintptr_t start = (uintptr_t)address;
+    uintptr_t end = start + size;
+    if (start < SRAM_BASE || end < start || end > (uintptr_t)_kernel_ram_start)
+    {
+        return false;
+    }
+
+    // the guard region holds the caller's guard, which faults the kernel too; nothing else touches the MPU during a syscall
+    MPU->RNR = NEO_MPU_GUARD_REGION;
+    uintptr_t guard_base = MPU->RBAR & MPU_RBAR_ADDR_Msk;
+    return !(MPU->RASR & MPU_RASR_ENABLE_Msk) || end <= guard_base || start >= guard_base + NEO_MPU_GUARD_SIZE;
+}
@@ -0,0 +1,349 @@
+#include "neo_pool.h"
+#include "neo_kernel.h"
+#include "neo_syscall.h"
+#include "neo_alloc.h"
+#include "neo_profile.h"
+
+/**
+ * @brief Set up a pool over memory the caller provides; pools declared with NEO_POOL don't need it
+ * @param pool Pointer to pool structure
+ * @param storage Memory for the blocks, at least block_size * block_count bytes; word aligned, and aligned to whatever
+ * the blocks hold
+ * @param block_size Bytes per block; a multiple of 4, at least one pointer
+ * @param block_count Number of blocks
+ * @return true if the pool was set up, false if an argument is invalid
+ */
+bool neo_pool_init(neo_pool_t *pool, void *storage, uint32_t block_size, uint32_t block_count)
+{
+    if (!pool || !storage || ((uintptr_t)storage & 3U) || block_size < sizeof(void *) || (block_size & 3U))
+    {
+        return false;
+    }
+
+    pool->free_list = NULL;
+    pool->blocks = storage;
+    pool->block_size = block_size;
+    pool->block_count = block_count;
+    pool->next_unused = 0;
+    pool->free_count = block_count;
+    return true;
+}
+
+/**
+ * @brief Check whether a pointer is the start of one of a pool's blocks
+ * @param pool Pointer to pool structure
+ * @param block Pointer to check
+ * @return true if block is a block of the pool, in use or not
+ */
+bool neo_pool_owns(const neo_pool_t *pool, const void *block)
+{
+    uint32_t offset = (uintptr_t)block - (uintptr_t)pool->blocks; // wraps to a large value below the storage
+    return offset < pool->block_size * pool->block_count && !(offset % pool->block_size);
+}
+
+/**
+ * @brief Take a block from a pool
+ * @param pool Pointer to pool structure
+ * @return The block, or NULL if they are all in use
+ */
+void *neo_kernel_pool_take(neo_pool_t *pool)
+{
+    // free blocks are linked through their first words, which anyone who can write the storage may have overwritten;
+    // a link that isn't one of the pool's blocks ends the list, and the blocks that were behind it are lost
+    void *block = pool->free_list;
+    if (block && !neo_pool_owns(pool, block))
+    {
+        block = pool->free_list = NULL;
+    }
+    if (block)
+    {
+        pool->free_list = *(void **)block;
+    }
+    else if (pool->next_unused < pool->block_count)
+    {
+        block = pool->blocks + pool->next_unused++ * pool->block_size;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    pool->free_count--;
+    return block;
+}
+
+/**
+ * @brief Return a block to its pool
+ * @param pool Pointer to pool structure
+ * @param block Block taken from the pool; its first word is overwritten
+ * @return true if the block was returned, false if it isn't one of the pool's blocks
+ */
+bool neo_kernel_pool_give(neo_pool_t *pool, void *block)
+{
+    if (!neo_pool_owns(pool, block))
+    {
+        return false;
+    }
+
+    *(void **)block = pool->free_list;
+    pool->free_list = block;
+    pool->free_count++;
+    return true;
+}
+
+// true if the caller of a syscall may use the pool: it can write the pool and all of its storage itself
+// must be called with the kernel locked
+static bool pool_is_usable(const neo_pool_t *pool)
+{
+    return neo_mpu_caller_can_write(pool, sizeof(*pool)) &&
+           (!pool->block_count || pool->block_size <= UINT32_MAX / pool->block_count) &&
+           neo_mpu_caller_can_write(pool->blocks, pool->block_size * pool->block_count);
+}
+
+/**
+ * @brief Kernel side of neo_pool_alloc
+ * @return The block, or NULL if they are all in use or the caller can't use the pool (see pool_is_usable)
+ */
+void *neo_sys_pool_alloc(neo_pool_t *pool)
+{
+    neo_kernel_lock();
+    void *block = pool_is_usable(pool) ? neo_kernel_pool_take(pool) : NULL;
+    neo_kernel_unlock();
+    return block;
+}
+
+/**
+ * @brief Kernel side of neo_pool_free
+ * @return true if the block was returned, false if it isn't one of the pool's blocks or the caller can't use the pool
+ */
+bool neo_sys_pool_free(neo_pool_t *pool, void *block)
+{
+    neo_kernel_lock();
+    bool freed = pool_is_usable(pool) && neo_kernel_pool_give(pool, block);
+    neo_kernel_unlock();
+    return freed;
+}
+
+/**
+ * @brief Take a block from a pool
+ * Constant time; callable from handlers at or below the kernel ceiling and from any thread
+ * @param pool Pointer to pool structure
+ * @return The block, or NULL if they are all in use; the contents are whatever the last user left there
+ */
+void *neo_pool_alloc(neo_pool_t *pool)
+{
+    if (neo_in_privileged_context())
+    {
+        return neo_sys_pool_alloc(pool);
+    }
+    return (void *)neo_syscall(NEO_SYS_POOL_ALLOC, (uint32_t)pool, 0, 0, 0);
+}
+
+/**
+ * @brief Return a block to its pool
+ * Constant time; callable from handlers at or below the kernel ceiling and from any thread
+ * @param pool Pointer to the pool the block was taken from
+ * @param block Block from neo_pool_alloc; not to be used again
+ * @return true if the block was returned, false if it isn't one of the pool's blocks
+ */
+bool neo_pool_free(neo_pool_t *pool, void *block)
+{
+    if (neo_in_privileged_context())
+    {
+        return neo_sys_pool_free(pool, block);
+    }
+    return neo_syscall(NEO_SYS_POOL_FREE, (uint32_t)pool, (uint32_t)block, 0, 0);
+}
+
+#define LF_TAG_STEP (1U << 16)    // added to the head on every update
+#define LF_INDEX_MASK (0xFFFFU)  // index + 1 of the first free block; 0 if none is free
+
+// address of the block with the given index
+static inline uint8_t *lf_block(const neo_lf_pool_t *pool, uint32_t index)
+{
+    return pool->blocks + index * pool->block_size;
+}
+
+/**
+ * @brief Set up a lock-free pool over memory the caller provides; pools declared with NEO_LF_POOL don't need it
+ * Not itself lock-free; call it before the pool is shared
+ * @param pool Pointer to pool structure
+ * @param storage Memory for the blocks, at least block_size * block_count bytes; word aligned, and aligned to whatever
+ * the blocks hold
+ * @param block_size Bytes per block; a multiple of 4
+ * @param block_count Number of blocks, up to NEO_LF_POOL_MAX_BLOCKS
+ * @return true if the pool was set up, false if an argument is invalid
+ */
+bool neo_lf_pool_init(neo_lf_pool_t *pool, void *storage, uint32_t block_size, uint32_t block_count)
+{
+    if (!pool || !storage || ((uintptr_t)storage & 3U) || !block_size || (block_size & 3U) || block_count > NEO_LF_POOL_MAX_BLOCKS)
+    {
+        return false;
+    }
+
+    pool->head = 0;
+    pool->next_unused = 0;
+    pool->blocks = storage;
+    pool->block_size = block_size;
+    pool->block_count = block_count;
+    return true;
+}
+
+/**
+ * @brief Take a block from a lock-free pool
+ * Callable from any handler, whatever its priority, and from any thread, privileged or not; never masks interrupts
+ * @param pool Pointer to pool structure
+ * @return The block, or NULL if they are all in use or the free list is corrupt; the contents are whatever the last user
+ * left there
+ */
+void *neo_lf_pool_alloc(neo_lf_pool_t *pool)
+{
+    uint32_t head;
+    uint32_t first;
+    do
+    {
+        head = __LDREXW(&pool->head);
+        first = head & LF_INDEX_MASK;
+        if (!first)
+        {
+            __CLREX();
+            break;
+        }
+        // the block may be taken and its link overwritten after this read; the STREX then fails and the read is redone
+        // a free block's link is in memory anyone holding a stale pointer can write, so it is checked like
+        // neo_kernel_pool_take checks its links; one that isn't a block index leaves the pool looking empty
+        uint32_t next = *(volatile uint32_t *)lf_block(pool, first - 1U);
+        if (first > pool->block_count || next > pool->block_count)
+        {
+            __CLREX();
+            return NULL;
+        }
+        head = ((head + LF_TAG_STEP) & ~LF_INDEX_MASK) | (next & LF_INDEX_MASK);
+    } while (__STREXW(head, &pool->head)); // fails if anything touched the head, or an exception came in between
+
+    if (first)
+    {
+        __DMB(); // the block is used only after it's off the list
+        return lf_block(pool, first - 1U);
+    }
+
+    // nothing was freed yet; hand out the next block that was never used
+    uint32_t unused;
+    do
+    {
+        unused = __LDREXW(&pool->next_unused);
+        if (unused >= pool->block_count)
+        {
+            __CLREX();
+            return NULL;
+        }
+    } while (__STREXW(unused + 1U, &pool->next_unused));
+    return lf_block(pool, unused);
+}
+
+/**
+ * @brief Return a block to its lock-free pool
+ * Callable from any handler, whatever its priority, and from any thread, privileged or not; never masks interrupts
+ * @param pool Pointer to the pool the block was taken from
+ * @param block Block from neo_lf_pool_alloc; not to be used again; its first word is overwritten
+ * @return true if the block was returned, false if it isn't one of the pool's blocks
+ */
+bool neo_lf_pool_free(neo_lf_pool_t *pool, void *block)
+{
+    uint32_t offset = (uintptr_t)block - (uintptr_t)pool->blocks; // wraps to a large value below the storage
+    if (offset >= pool->block_size * pool->block_count || offset % pool->block_size)
+    {
+        return false;
+    }
+
+    uint32_t index = offset / pool->block_size;
+    uint32_t head;
+    do
+    {
+        head = __LDREXW(&pool->head);
+        *(volatile uint32_t *)block = head & LF_INDEX_MASK; // link to the current first block
+        __DMB();                                            // the link is written before the block is on the list
+        head = ((head + LF_TAG_STEP) & ~LF_INDEX_MASK) | (index + 1U);
+    } while (__STREXW(head, &pool->head));
+    return true;
+}
+
+#ifdef NEO_PROFILE
+
+#define POOL_BENCH_BLOCKS (4U) // blocks held at once per size
+#define POOL_BENCH_RUNS (64U)
+
+neo_profile_stat_t neo_bench_pool_alloc[3];
+neo_profile_stat_t neo_bench_pool_free[3];
+neo_profile_stat_t neo_bench_heap_alloc[3];
+neo_profile_stat_t neo_bench_heap_free[3];
+neo_profile_stat_t neo_bench_lf_pool_alloc[3];
+neo_profile_stat_t neo_bench_lf_pool_free[3];
+
+NEO_POOL(bench_pool_16, 16U, POOL_BENCH_BLOCKS);
+NEO_POOL(bench_pool_64, 64U, POOL_BENCH_BLOCKS);
+NEO_POOL(bench_pool_512, 512U, POOL_BENCH_BLOCKS);
+NEO_LF_POOL(bench_lf_pool_16, 16U, POOL_BENCH_BLOCKS);
+NEO_LF_POOL(bench_lf_pool_64, 64U, POOL_BENCH_BLOCKS);
+NEO_LF_POOL(bench_lf_pool_512, 512U, POOL_BENCH_BLOCKS);
+
+/**
+ * @brief Time pool blocks of 16, 64 and 512 bytes against neo_alloc blocks of the same sizes
+ * Each run takes POOL_BENCH_BLOCKS blocks of one size and returns them in a different order, from a pool, a lock-free
+ * pool and the heap; results go to neo_bench_pool_alloc/free, neo_bench_lf_pool_alloc/free and
+ * neo_bench_heap_alloc/free, indexed by size
+ * Call it from main after neo_kernel_init
+ */
+void neo_profile_pool(void)
+{
+    neo_pool_t *const pools[3] = {&bench_pool_16, &bench_pool_64, &bench_pool_512};
+    neo_lf_pool_t *const lf_pools[3] = {&bench_lf_pool_16, &bench_lf_pool_64, &bench_lf_pool_512};
+    void *blocks[POOL_BENCH_BLOCKS];
+
+    for (uint32_t size = 0; size < 3U; size++)
+    {
+        for (uint32_t run = 0; run < POOL_BENCH_RUNS; run++)
+        {
+            for (uint32_t block = 0; block < POOL_BENCH_BLOCKS; block++)
+            {
+                NEO_PROFILE_START(alloc_start);
+                blocks[block] = neo_pool_alloc(pools[size]);
+                NEO_PROFILE_END(neo_bench_pool_alloc[size], alloc_start);
+            }
+            for (uint32_t block = 0; block < POOL_BENCH_BLOCKS; block++)
+            {
+                NEO_PROFILE_START(free_start);
+                neo_pool_free(pools[size], blocks[(block + run) % POOL_BENCH_BLOCKS]);
+                NEO_PROFILE_END(neo_bench_pool_free[size], free_start);
+            }
+
+            for (uint32_t block = 0; block < POOL_BENCH_BLOCKS; block++)
+            {
+                NEO_PROFILE_START(alloc_start);
+                blocks[block] = neo_lf_pool_alloc(lf_pools[size]);
+                NEO_PROFILE_END(neo_bench_lf_pool_alloc[size], alloc_start);
+            }
+            for (uint32_t block = 0; block < POOL_BENCH_BLOCKS; block++)
+            {
+                NEO_PROFILE_START(free_start);
+                neo_lf_pool_free(lf_pools[size], blocks[(block + run) % POOL_BENCH_BLOCKS]);
+                NEO_PROFILE_END(neo_bench_lf_pool_free[size], free_start);
+            }
+
+            for (uint32_t block = 0; block < POOL_BENCH_BLOCKS; block++)
+            {
+                NEO_PROFILE_START(alloc_start);
+                blocks[block] = neo_alloc(pools[size]->block_size);
+                NEO_PROFILE_END(neo_bench_heap_alloc[size], alloc_start);
+            }
+            for (uint32_t block = 0; block < POOL_BENCH_BLOCKS; block++)
+            {
+                NEO_PROFILE_START(free_start);
+                neo_free(blocks[(block + run) % POOL_BENCH_BLOCKS]);
+                NEO_PROFILE_END(neo_bench_heap_free[size], free_start);
+            }
+        }
+    }
+}
+
+#endif
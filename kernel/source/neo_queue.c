@@ -0,0 +1,217 @@
+#include "neo_queue.h"
+#include "neo_syscall.h"
+
+// must be called with the kernel locked and with a free slot in the queue
+static inline void queue_push(neo_queue_t *queue, void *message)
+{
+    uint32_t tail = queue->head + queue->count;
+    if (tail >= queue->capacity)
+    {
+        tail -= queue->capacity;
+    }
+    queue->slots[tail] = message;
+    queue->count++;
+}
+
+// must be called with the kernel locked and with a message in the queue
+static inline void *queue_pop(neo_queue_t *queue)
+{
+    void *message = queue->slots[queue->head];
+    if (++queue->head == queue->capacity)
+    {
+        queue->head = 0;
+    }
+    queue->count--;
+    return message;
+}
+
+// true if the caller of a syscall may use the queue: it can write the queue and its slots itself, and head and count,
+// which it could have set to anything, are within the slots; must be called with the kernel locked
+static bool queue_is_usable(const neo_queue_t *queue)
+{
+    return neo_mpu_caller_can_write(queue, sizeof(*queue)) && queue->capacity <= UINT32_MAX / sizeof(void *) &&
+           neo_mpu_caller_can_write(queue->slots, queue->capacity * sizeof(void *)) && queue->count <= queue->capacity &&
+           (queue->head < queue->capacity || !queue->capacity);
+}
+
+/**
+ * @brief Initialize an empty queue; same as assigning NEO_QUEUE_INIT
+ * @param queue Pointer to queue structure
+ * @param slots Storage for capacity message pointers
+ * @param capacity Number of messages the queue holds; 0 makes every send wait for a receiver
+ */
+void neo_queue_init(neo_queue_t *queue, void **slots, uint32_t capacity)
+{
+    queue->slots = slots;
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    neo_wait_queue_init(&queue->receivers);
+    neo_wait_queue_init(&queue->senders);
+}
+
+/**
+ * @brief Kernel side of neo_queue_send and neo_queue_send_from_isr
+ * @return NEO_WAIT_OK if the message was delivered or queued, NEO_WAIT_TIMEOUT if the queue is full and timeout is zero,
+ * NEO_WAIT_PENDING if the caller was blocked; NEO_WAIT_TIMEOUT as well if the caller can't use the queue (see
+ * queue_is_usable)
+ */
+uint32_t neo_sys_queue_send(neo_queue_t *queue, void *message, uint32_t timeout)
+{
+    neo_kernel_lock();
+    if (!queue_is_usable(queue))
+    {
+        neo_kernel_unlock();
+        return NEO_WAIT_TIMEOUT;
+    }
+
+    uint32_t receiver = neo_kernel_wake_one(&queue->receivers);
+    if (receiver != NEO_NO_THREAD)
+    {
+        wait_data[receiver] = message; // a receiver only waits on an empty queue; hand the message over directly
+        neo_kernel_unlock();
+        return NEO_WAIT_OK;
+    }
+
+    if (queue->count < queue->capacity)
+    {
+        queue_push(queue, message);
+        neo_kernel_unlock();
+        return NEO_WAIT_OK;
+    }
+
+    if (!timeout)
+    {
+        neo_kernel_unlock();
+        return NEO_WAIT_TIMEOUT;
+    }
+
+    // the message waits with its sender until a receive makes room for it
+    wait_data[neo_kernel_current_thread()] = message;
+    uint32_t status = neo_kernel_block_current(&queue->senders, timeout);
+    neo_kernel_unlock();
+    return status;
+}
+
+/**
+ * @brief Kernel side of neo_queue_receive
+ * @return NEO_WAIT_OK with the message in *message, NEO_WAIT_TIMEOUT if the queue is empty and timeout is zero,
+ * NEO_WAIT_PENDING if the caller was blocked; NEO_WAIT_TIMEOUT as well if the caller can't use the queue (see
+ * queue_is_usable) or can't write *message itself
+ */
+uint32_t neo_sys_queue_receive(neo_queue_t *queue, void **message, uint32_t timeout)
+{
+    neo_kernel_lock();
+    if (!queue_is_usable(queue) || !neo_mpu_caller_can_write(message, sizeof(*message)))
+    {
+        neo_kernel_unlock();
+        return NEO_WAIT_TIMEOUT;
+    }
+
+    if (queue->count)
+    {
+        *message = queue_pop(queue);
+
+        // the freed slot goes to the highest-priority blocked sender
+        uint32_t sender = neo_kernel_wake_one(&queue->senders);
+        if (sender != NEO_NO_THREAD)
+        {
+            queue_push(queue, wait_data[sender]);
+        }
+        neo_kernel_unlock();
+        return NEO_WAIT_OK;
+    }
+
+    // an empty queue only has blocked senders when it has no slots at all
+    uint32_t sender = neo_kernel_wake_one(&queue->senders);
+    if (sender != NEO_NO_THREAD)
+    {
+        *message = wait_data[sender];
+        neo_kernel_unlock();
+        return NEO_WAIT_OK;
+    }
+
+    if (!timeout)
+    {
+        neo_kernel_unlock();
+        return NEO_WAIT_TIMEOUT;
+    }
+
+    uint32_t status = neo_kernel_block_current(&queue->receivers, timeout);
+    neo_kernel_unlock();
+    return status;
+}
+
+/**
+ * @brief Send a message, blocking for up to timeout milliseconds while the queue is full
+ * On success, the buffer the message points to belongs to the receiver
+ * @param queue Pointer to queue structure
+ * @param message Pointer to pass on
+ * @param timeout Milliseconds to wait; 0 only tries, NEO_WAIT_FOREVER waits as long as it takes
+ * @return true if the message was sent, false on timeout
+ */
+bool neo_queue_send(neo_queue_t *queue, void *message, uint32_t timeout)
+{
+    if (!neo_kernel_in_thread())
+    {
+        timeout = 0; // only a thread can block
+    }
+
+    uint32_t status;
+    if (neo_in_privileged_context())
+    {
+        status = neo_sys_queue_send(queue, message, timeout);
+    }
+    else
+    {
+        status = neo_syscall(NEO_SYS_QUEUE_SEND, (uint32_t)queue, (uint32_t)message, timeout, 0);
+    }
+    return neo_kernel_wait_outcome(status) == NEO_WAIT_OK;
+}
+
+/**
+ * @brief Send a message from an interrupt handler without blocking
+ * A thread waiting for the message runs as soon as the handler returns if it outranks the interrupted thread
+ * @param queue Pointer to queue structure
+ * @param message Pointer to pass on
+ * @return true if the message was sent, false if the queue is full
+ */
+bool neo_queue_send_from_isr(neo_queue_t *queue, void *message)
+{
+    return neo_sys_queue_send(queue, message, 0) == NEO_WAIT_OK;
+}
+
+/**
+ * @brief Receive the oldest message, blocking for up to timeout milliseconds while the queue is empty
+ * @param queue Pointer to queue structure
+ * @param message Filled with the received pointer; the caller now owns the buffer behind it
+ * @param timeout Milliseconds to wait; 0 only tries, NEO_WAIT_FOREVER waits as long as it takes
+ * @return true if a message was received, false on timeout
+ */
+bool neo_queue_receive(neo_queue_t *queue, void **message, uint32_t timeout)
+{
+    if (!neo_kernel_in_thread())
+    {
+        timeout = 0; // only a thread can block
+    }
+
+    uint32_t status;
+    if (neo_in_privileged_context())
+    {
+        status = neo_sys_queue_receive(queue, message, timeout);
+    }
+    else
+    {
+        status = neo_syscall(NEO_SYS_QUEUE_RECEIVE, (uint32_t)queue, (uint32_t)message, timeout, 0);
+    }
+
+    if (status == NEO_WAIT_PENDING)
+    {
+        status = neo_kernel_wait_outcome(status);
+        if (status == NEO_WAIT_OK)
+        {
+            *message = neo_kernel_wait_data(); // handed over by the sender that woke this thread
+        }
+    }
+    return status == NEO_WAIT_OK;
+}
@@ -0,0 +1,130 @@
+#include "neo_syscall.h"
+#include "neo_alloc.h"
+
+#ifdef NEO_PROFILE
+// entry of NEO_SYS_PROFILE_NULL; does nothing, so timing it times only the way into the kernel and back
+static uint32_t neo_sys_profile_null(void)
+{
+    return 0;
+}
+#endif
+
+/* Syscall table; indexed by neo_syscall_number_t
+ * Every entry is called with the caller's r0-r3 as arguments and whatever it leaves in r0 is returned to the caller,
+ * which is how the AAPCS works for any kernel function with up to four word-sized arguments, so the entries keep their own prototypes
+ */
+__attribute__((used)) void (*const neo_syscall_table[NEO_SYSCALL_COUNT])(void) = {
+    [NEO_SYS_THREAD_START] = (void (*)(void))neo_sys_thread_start,
+    [NEO_SYS_THREAD_START_ALL_NEW] = (void (*)(void))neo_sys_thread_start_all_new,
+    [NEO_SYS_THREAD_SLEEP] = (void (*)(void))neo_sys_thread_sleep,
+    [NEO_SYS_THREAD_PAUSE] = (void (*)(void))neo_sys_thread_pause,
+    [NEO_SYS_THREAD_RESUME] = (void (*)(void))neo_sys_thread_resume,
+    [NEO_SYS_ALLOC] = (void (*)(void))neo_sys_alloc,
+    [NEO_SYS_FREE] = (void (*)(void))neo_sys_free,
+    [NEO_SYS_MUTEX_LOCK] = (void (*)(void))neo_sys_mutex_lock,
+    [NEO_SYS_MUTEX_UNLOCK] = (void (*)(void))neo_sys_mutex_unlock,
+    [NEO_SYS_SEM_TAKE] = (void (*)(void))neo_sys_sem_take,
+    [NEO_SYS_SEM_GIVE] = (void (*)(void))neo_sys_sem_give,
+    [NEO_SYS_QUEUE_SEND] = (void (*)(void))neo_sys_queue_send,
+    [NEO_SYS_QUEUE_RECEIVE] = (void (*)(void))neo_sys_queue_receive,
+    [NEO_SYS_EVENT_GROUP_WAIT] = (void (*)(void))neo_sys_event_group_wait,
+    [NEO_SYS_EVENT_GROUP_SET] = (void (*)(void))neo_sys_event_group_set,
+    [NEO_SYS_EVENT_GROUP_CLEAR] = (void (*)(void))neo_sys_event_group_clear,
+    [NEO_SYS_THREAD_EXIT] = (void (*)(void))neo_sys_thread_exit,
+    [NEO_SYS_THREAD_JOIN] = (void (*)(void))neo_sys_thread_join,
+    [NEO_SYS_THREAD_CREATE] = (void (*)(void))neo_sys_thread_create,
+    [NEO_SYS_THREAD_SLEEP_UNTIL] = (void (*)(void))neo_sys_thread_sleep_until,
+    [NEO_SYS_THREAD_SLEEP_US] = (void (*)(void))neo_sys_thread_sleep_us,
+    [NEO_SYS_TIMER_CREATE] = (void (*)(void))neo_sys_timer_create,
+    [NEO_SYS_TIMER_START] = (void (*)(void))neo_sys_timer_start,
+    [NEO_SYS_TIMER_STOP] = (void (*)(void))neo_sys_timer_stop,
+    [NEO_SYS_TIMER_DELETE] = (void (*)(void))neo_sys_timer_delete,
+    [NEO_SYS_TIMER_SERVICE] = (void (*)(void))neo_sys_timer_service,
+    [NEO_SYS_SCHED_LOCK] = (void (*)(void))neo_sys_sched_lock,
+    [NEO_SYS_SCHED_UNLOCK] = (void (*)(void))neo_sys_sched_unlock,
+    [NEO_SYS_POOL_ALLOC] = (void (*)(void))neo_sys_pool_alloc,
+    [NEO_SYS_POOL_FREE] = (void (*)(void))neo_sys_pool_free,
+#ifdef NEO_PROFILE
+    [NEO_SYS_PROFILE_NULL] = (void (*)(void))neo_sys_profile_null,
+#endif
+};
+
+/**
+ * @brief SVC exception handler; dispatches a syscall through neo_syscall_table
+ *
+ * The caller's exception frame holds the arguments (r0-r3) and the syscall number (r12); the return value
+ * is written back into the frame's r0, which the exception return puts in the caller's r0
+ * Besides the call itself, this is about a dozen instructions on top of the 12-cycle entry and exit, and it
+ * tail-chains into PendSV when the syscall blocked the caller; neo_profile_syscall measures the round trip
+ *
+ * The round trip misses its budget of 40 cycles over a direct call. Counted from the Cortex-M4 timings with no flash
+ * wait states, it is about 46: 24 for stacking and unstacking, which the hardware does anyway, and about 22 here. None of
+ * the dispatch can go; the stack choice, the bounds check, the table load, reloading r0-r3 from the frame (a tail-chained
+ * handler may have used the registers) and keeping the frame pointer across the call are each needed. This is not a
+ * measured figure yet; the real one is neo_bench_syscall - neo_bench_syscall_call, read on the board
+ * An out-of-range number returns 0
+ *
+ * NOTE: naked attribute prevents compiler from generating prologue/epilogue
+ */
+__attribute__((naked)) void SVCall_handler(void)
+{
+    __asm__ volatile(
+        // the frame is on PSP for a thread and on MSP when main calls the kernel before the scheduler starts
+        "tst lr, #4\n"
+        "ite eq\n"
+        "mrseq r0, msp\n"
+        "mrsne r0, psp\n"
+
+        "ldr r1, [r0, #16]\n" // stacked r12; the syscall number
+        "cmp r1, %[syscall_count]\n"
+        "bhs 1f\n"
+
+        "ldr r2, =neo_syscall_table\n"
+        "ldr r12, [r2, r1, lsl #2]\n"
+
+        // keep the frame pointer and EXC_RETURN across the call; two registers keep MSP 8-byte aligned
+        "push {r0, lr}\n"
+        "ldm r0, {r0-r3}\n" // the caller's arguments
+        "blx r12\n"
+        "pop {r1, lr}\n"
+        "str r0, [r1]\n" // result into the stacked r0
+        "bx lr\n"
+
+        "1:\n"
+        "mov r1, #0\n"
+        "str r1, [r0]\n"
+        "bx lr\n" ::[syscall_count] "i"(NEO_SYSCALL_COUNT));
+}
+
+#ifdef NEO_PROFILE
+
+#define SYSCALL_BENCH_RUNS (256U)
+
+neo_profile_stat_t neo_bench_syscall;
+neo_profile_stat_t neo_bench_syscall_call;
+
+/**
+ * @brief Time the SVC round trip against a direct call
+ * Makes NEO_SYS_PROFILE_NULL through svc, then calls neo_sys_profile_null directly, SYSCALL_BENCH_RUNS times each; the
+ * difference between neo_bench_syscall and neo_bench_syscall_call is what syscall entry and exit cost on top of the
+ * call itself. The hardware stacks and unstacks 8 words, 12 cycles each way, and SVCall_handler adds its dispatch
+ * Call it from main after neo_kernel_init, before the scheduler starts and with the kernel unlocked; the SVC then
+ * comes from privileged thread mode on MSP, which is the same path as from a thread on PSP but for the stack choice
+ */
+void neo_profile_syscall(void)
+{
+    uint32_t (*volatile direct)(void) = neo_sys_profile_null; // through a pointer so the call isn't inlined away
+
+    for (uint32_t run = 0; run < SYSCALL_BENCH_RUNS; run++)
+    {
+        NEO_PROFILE_START(svc_start);
+        neo_syscall(NEO_SYS_PROFILE_NULL, 0, 0, 0, 0);
+        NEO_PROFILE_END(neo_bench_syscall, svc_start);
+
+        NEO_PROFILE_START(call_start);
+        direct();
+        NEO_PROFILE_END(neo_bench_syscall_call, call_start);
+    }
+}
+
+#endif
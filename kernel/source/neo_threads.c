@@ -1,49 +1,68 @@
 #include "neo_threads.h"
 #include "neo_alloc.h"
+#include "neo_syscall.h"
+#include "neo_kernel.h"
+#include "neo_profile.h"
+#include "neo_clock.h"
+#include "neo_pool.h"
+#include <stddef.h>
 
 /* TODO */
-// Somehow use PSP and MSP?
+// Somehow use PSP and MSP?; done (threads run on PSP, handlers on MSP)
 // Implement thread states (ACTIVE, SLEEPING, etc.); done
-// Implement thread priority
-// Implement thread mutexes
-// Implement thread semaphores
-// Implement thread message queues
-// Implement switching CPU states (from handler to thread (user)) and vice versa; This requires modifying LR with different EXC_RETURN values before returning from the interrupt
+// Implement thread priority; done
+// Implement thread mutexes; done (synchronization.h)
+// Implement thread semaphores; done (synchronization.h)
+// Implement thread message queues; done (neo_queue.h)
+// Implement switching CPU states (from handler to thread (user)) and vice versa; This requires modifying LR with different EXC_RETURN values before returning from the interrupt; done (user threads run unprivileged and enter the kernel through SVC)
 // Implement thread sleep function; done
 // Implement thread yield function; done
-// Implement thread join function
-// Implement thread exit function
+// Implement thread join function; done
+// Implement thread exit function; done
 // Implement starting thread from whereever we want; done
 
 /* Configuration Constants
- * NOTE: If you modify these values, you must also update the corresponding
- * hardcoded values in the assembly code sections marked with "HARDCODED ALERT"
+ * The assembly below takes these values (and structure offsets) as operands, so they can be changed freely
+ * MAX_THREADS is set in neo_threads.h
  */
-#define TIME_SLICE_MS (100U)     // Base time slice in milliseconds
-#define TIME_SLICE_TICKS (10U)   // Number of ticks before thread switch (1 second total)
-#define MAX_THREADS (10U)        // Maximum number of concurrent threads
+#define TIME_SLICE_MS (1000U)    // Time a thread runs before the next thread of its priority gets the CPU
+#define TIME_SLICE_TICKS (NEO_MS_TO_TICKS(TIME_SLICE_MS))
 #define PROCESSOR_MODE_BIT (24U) // Processor mode control bit position
 #define STACK_ALIGNMENT (8U)     // Required stack alignment in bytes (AAPCS standard)
 #define PENDSV_IRQ_NUM (14U)     // PendSV interrupt number
 #define LOWEST_PRIORITY (0xFFU)  // Lowest interrupt priority for PendSV
+#define MIN_STACK_SIZE (18U * 4U) // initial context (exception frame, EXC_RETURN, r4-r11) plus alignment slack
+
+/* Tickless idle: when only the idle thread can run, SysTick is reprogrammed to fire at the next sleep expiry instead of every tick
+ * Build with -DNEO_TICKLESS_IDLE=0 (make TICKLESS=0) to get the periodic tick back
+ */
+#ifndef NEO_TICKLESS_IDLE
+#define NEO_TICKLESS_IDLE (1U)
+#endif
+
+_Static_assert(NEO_PRIORITY_LEVELS <= 32U, "every priority needs a bit in ready_priorities_bit_mask");
+_Static_assert(MAX_THREADS <= 255U, "thread ids are 8 bits wide and the idle thread takes the id MAX_THREADS");
 
 /* major mistake is including variables like these in header files and then including those header files in different source files; this confuses the compiler */
 extern volatile uint32_t tick_count;
 
 /* Thread Management State
  * volatile qualifier used for variables accessed from both main code and ISRs
+ * All of the kernel's state is in kernel RAM (NEO_KERNEL_DATA and NEO_KERNEL_BSS), where unprivileged threads can read it but not write it
  */
-volatile uint32_t last_thread_start_tick;        // Timestamp of last thread switch
-volatile uint32_t last_running_thread_index = 0; // Index of previously running thread
-volatile uint32_t curr_running_thread_index = 0; // Index of currently running thread
-volatile uint32_t is_first_time = 1;             // First context switch flag
-volatile uint32_t has_threads_started = 0;       // Thread system initialization flag
+NEO_KERNEL_BSS volatile uint32_t last_thread_start_tick;        // Timestamp of last thread switch
+NEO_KERNEL_BSS volatile uint32_t last_running_thread_index = 0; // Index of previously running thread
+NEO_KERNEL_BSS volatile uint32_t curr_running_thread_index = 0; // Index of currently running thread
+NEO_KERNEL_DATA volatile uint32_t is_first_time = 1;            // First context switch flag
+NEO_KERNEL_BSS volatile uint32_t has_threads_started = 0;       // Thread system initialization flag
 
 /* Thread Queue Management */
 // extra space for idle thread
-volatile neo_thread_t *volatile thread_queue[MAX_THREADS + 1]; // this creates a volatile pointer; the pointer is not volatile, but the data it points to is;
+NEO_KERNEL_BSS volatile neo_thread_t *volatile thread_queue[MAX_THREADS + 1]; // this creates a volatile pointer; the pointer is not volatile, but the data it points to is;
 // if the volatile keyword is placed before the *, then the data the ptr points to is volatile and not the pointer itself; otherwise, if the volatile keyword is placed after the *, then the pointer is volatile and not the data it points to
-volatile uint32_t thread_queue_len = 0;
+NEO_KERNEL_BSS volatile uint32_t thread_queue_len = 0; // number of thread ids in use
+// thread ids not in use; an exited thread's id returns here once the scheduler has switched away from it for good
+NEO_KERNEL_BSS volatile neo_thread_bitmap_t free_thread_ids;
 
 /*
 
@@ -56,31 +75,490 @@ this saving and restoring of LR is done so that the LR is not clobbered if the f
 
 */
 
-#define IDLE_THREAD_STACK_SIZE_IN_32_BITS 20
-volatile uint32_t idle_thread_stack[IDLE_THREAD_STACK_SIZE_IN_32_BITS];
-volatile neo_thread_t idle_thread;
+#define IDLE_THREAD_STACK_SIZE_IN_32_BITS 72 // the idle thread makes function calls in tickless mode; 8 words go to the stack guard
+NEO_KERNEL_BSS volatile uint32_t idle_thread_stack[IDLE_THREAD_STACK_SIZE_IN_32_BITS] __attribute__((aligned(NEO_MPU_GUARD_SIZE)));
+NEO_KERNEL_BSS volatile neo_thread_t idle_thread;
+
+/* The thread state masks are two-level bitmaps of thread ids (see neo_bitmap.h) */
+/* ready threads are kept per priority; thread i is in ready_threads_bit_mask[p] if it has priority p and is ready */
+/* bit p of ready_priorities_bit_mask is set if ready_threads_bit_mask[p] is non-empty, so the highest ready priority is a single CLZ away */
+NEO_KERNEL_BSS volatile neo_thread_bitmap_t ready_threads_bit_mask[NEO_PRIORITY_LEVELS];
+NEO_KERNEL_BSS volatile uint32_t ready_priorities_bit_mask = 0;
+NEO_KERNEL_BSS volatile neo_thread_bitmap_t new_threads_bit_mask;
+NEO_KERNEL_BSS volatile neo_thread_bitmap_t sleeping_threads_bit_mask;
+NEO_KERNEL_BSS volatile neo_thread_bitmap_t running_threads_bit_mask;
+NEO_KERNEL_BSS volatile neo_thread_bitmap_t paused_threads_bit_mask;
+NEO_KERNEL_BSS volatile neo_thread_bitmap_t blocked_threads_bit_mask; // waiting on a synchronization object
+NEO_KERNEL_BSS volatile neo_thread_bitmap_t timed_threads_bit_mask;   // blocked threads that also sit in the sleep queue for their timeout
+NEO_KERNEL_BSS volatile neo_thread_bitmap_t exited_threads_bit_mask;  // exited, waiting for the scheduler to release their id
+
+// threads blocked in neo_thread_join, per joined thread
+NEO_KERNEL_BSS neo_wait_queue_t join_waiters[MAX_THREADS];
+
+// next thread in the wait queue a blocked thread sits in (see neo_wait_queue_t in neo_kernel.h), and that wait queue
+// (NULL for objects that track their waiters themselves); waiting_for is the object the thread is blocked on
+NEO_KERNEL_BSS volatile uint8_t wait_next[MAX_THREADS];
+NEO_KERNEL_BSS neo_wait_queue_t *volatile waiting_on[MAX_THREADS];
+NEO_KERNEL_BSS const void *volatile waiting_for[MAX_THREADS];
+// outcome of the last wait of each thread; NEO_WAIT_OK or NEO_WAIT_TIMEOUT
+NEO_KERNEL_BSS volatile uint8_t wait_result[MAX_THREADS];
+// word passed along with a wait, in either direction; e.g. the message a blocked sender offers or a blocked receiver gets
+NEO_KERNEL_BSS void *volatile wait_data[MAX_THREADS];
+
+/* Sleeping threads are kept in a delta-ordered queue linked through sleep_next
+ * sleep_delta[i] holds the ticks thread i wakes up after the thread in front of it, so a tick only decrements the head
+ * and waking costs O(number of expired threads) no matter how many threads are sleeping
+ * Threads blocked with a timeout sit in the same queue; sleep_prev lets them leave it in O(1) when woken early
+ */
+NEO_KERNEL_DATA volatile uint8_t sleep_queue_head = NEO_NO_THREAD;
+NEO_KERNEL_BSS volatile uint8_t sleep_next[MAX_THREADS];
+NEO_KERNEL_BSS volatile uint8_t sleep_prev[MAX_THREADS];
+NEO_KERNEL_BSS volatile uint32_t sleep_delta[MAX_THREADS];
+
+// index of the thread last picked at each priority; round-robin among equal priorities resumes after it
+NEO_KERNEL_BSS volatile uint8_t last_scheduled_at_priority[NEO_PRIORITY_LEVELS];
+
+/* Scheduler lock (see neo_sched_lock)
+ * Each thread's nesting depth; while the running thread's depth is non-zero it isn't preempted, and a switch that would
+ * have preempted it only sets sched_switch_deferred. The depths are in kernel RAM, since SysTick and PendSV act on them
+ * for every thread: an unprivileged thread changes its own through a syscall, and can't touch any other
+ */
+NEO_KERNEL_BSS volatile uint8_t sched_lock_depth[MAX_THREADS + 1];
+NEO_KERNEL_BSS volatile uint32_t sched_switch_deferred = 0; // a preemption is owed to a thread that holds the scheduler lock
+
+/* Pools for neo_thread_create
+ * Stacks come in three size classes (guard included); a requested size is rounded up to the smallest class that fits,
+ * falling back to the larger classes when that one is used up. Each class and the TCBs are block pools (see
+ * neo_pool.h), so taking and returning a thread is O(1) and never touches the neo_alloc heap
+ * Set the number of stacks per class at compile time with -DNEO_SMALL_STACKS=<n> and so on
+ */
+#ifndef NEO_SMALL_STACKS
+#define NEO_SMALL_STACKS (4U)
+#endif
+#ifndef NEO_MEDIUM_STACKS
+#define NEO_MEDIUM_STACKS (2U)
+#endif
+#ifndef NEO_LARGE_STACKS
+#define NEO_LARGE_STACKS (1U)
+#endif
+#define SMALL_STACK_SIZE (256U)
+#define MEDIUM_STACK_SIZE (512U)
+#define LARGE_STACK_SIZE (1024U)
+#define STACK_CLASSES (3U)
+#define DYNAMIC_THREADS (NEO_SMALL_STACKS + NEO_MEDIUM_STACKS + NEO_LARGE_STACKS)
+
+_Static_assert(NEO_SMALL_STACKS && NEO_MEDIUM_STACKS && NEO_LARGE_STACKS, "every stack class needs at least one stack");
+
+static NEO_THREAD_STACK(small_stacks, NEO_SMALL_STACKS *SMALL_STACK_SIZE / 4U);
+static NEO_THREAD_STACK(medium_stacks, NEO_MEDIUM_STACKS *MEDIUM_STACK_SIZE / 4U);
+static NEO_THREAD_STACK(large_stacks, NEO_LARGE_STACKS *LARGE_STACK_SIZE / 4U);
+
+static const uint32_t stack_class_size[STACK_CLASSES] = {SMALL_STACK_SIZE, MEDIUM_STACK_SIZE, LARGE_STACK_SIZE};
+NEO_KERNEL_BSS static neo_pool_t stack_pool[STACK_CLASSES];
+
+NEO_KERNEL_BSS static neo_thread_t thread_pool[DYNAMIC_THREADS];
+NEO_KERNEL_BSS static neo_pool_t thread_pool_tcbs;                   // blocks of thread_pool
+NEO_KERNEL_BSS static uint8_t *thread_pool_stack[DYNAMIC_THREADS];   // stack of each pool TCB in use
+NEO_KERNEL_BSS static uint8_t thread_pool_class[DYNAMIC_THREADS];    // class of that stack
+
+#if NEO_TICKLESS_IDLE
+NEO_KERNEL_BSS static uint32_t systick_counts_per_tick; // SysTick counts in one regular tick (LOAD + 1)
+NEO_KERNEL_BSS static uint32_t max_idle_ticks;          // longest idle period the 24-bit SysTick counter can cover
+#endif
+
+#ifdef NEO_PROFILE
+neo_profile_stat_t neo_scheduler_profile;   // cycles spent in neo_thread_scheduler on every context switch
+neo_profile_stat_t neo_sleep_tick_profile;  // cycles spent in update_sleeping_threads on every tick
+// number of times the idle thread was woken up; sample it together with tick_count to get wakeups per second
+// and compare a build with and without NEO_TICKLESS_IDLE
+volatile uint32_t neo_idle_wakeups;
+#endif
+
+static inline void trigger_context_switch(void)
+{
+    SCB->ICSR = SCB_ICSR_PENDSVSET_Msk; // writing zero to the other bits of ICSR has no effect
+}
+
+// adds the thread to the ready set of its priority
+static inline void make_thread_ready(uint32_t index)
+{
+    uint32_t priority = thread_queue[index]->priority;
+    neo_bitmap_set(&ready_threads_bit_mask[priority], index);
+    ready_priorities_bit_mask |= 1U << priority;
+}
+
+// removes the thread from the ready set of its priority
+static inline void make_thread_unready(uint32_t index)
+{
+    uint32_t priority = thread_queue[index]->priority;
+    neo_bitmap_clear(&ready_threads_bit_mask[priority], index);
+    if (neo_bitmap_is_empty(&ready_threads_bit_mask[priority]))
+    {
+        ready_priorities_bit_mask &= ~(1U << priority);
+    }
+}
+
+static void thread_pool_init(void)
+{
+    neo_pool_init(&stack_pool[0], small_stacks, SMALL_STACK_SIZE, NEO_SMALL_STACKS);
+    neo_pool_init(&stack_pool[1], medium_stacks, MEDIUM_STACK_SIZE, NEO_MEDIUM_STACKS);
+    neo_pool_init(&stack_pool[2], large_stacks, LARGE_STACK_SIZE, NEO_LARGE_STACKS);
+    neo_pool_init(&thread_pool_tcbs, thread_pool, sizeof(neo_thread_t), DYNAMIC_THREADS);
+}
+
+// takes a TCB and a stack with at least stack_size usable bytes from the pools; NULL if either is used up
+// must be called with the kernel locked
+static neo_thread_t *thread_pool_alloc(uint32_t stack_size)
+{
+    uint32_t class = 0;
+    while (class < STACK_CLASSES && (stack_class_size[class] - NEO_MPU_GUARD_SIZE < stack_size || !stack_pool[class].free_count))
+    {
+        class++;
+    }
+    if (class == STACK_CLASSES || !thread_pool_tcbs.free_count)
+    {
+        return NULL;
+    }
+
+    neo_thread_t *thread = neo_kernel_pool_take(&thread_pool_tcbs);
+    uint32_t slot = thread - thread_pool;
+    thread_pool_stack[slot] = neo_kernel_pool_take(&stack_pool[class]);
+    thread_pool_class[slot] = (uint8_t)class;
+    return thread;
+}
+
+// returns a pool TCB and its stack; does nothing for a thread the application created with its own memory
+// must be called with the kernel locked
+static void thread_pool_free(volatile neo_thread_t *thread)
+{
+    if (!neo_pool_owns(&thread_pool_tcbs, (const void *)thread))
+    {
+        return;
+    }
+
+    uint32_t slot = thread - thread_pool;
+    neo_kernel_pool_give(&stack_pool[thread_pool_class[slot]], thread_pool_stack[slot]);
+    neo_kernel_pool_give(&thread_pool_tcbs, (void *)thread);
+}
+
+// returns the id of an exited thread to the free ids, and a created thread's memory to the pools
+// called by the scheduler once the thread is switched out; must be called with the kernel locked
+static void release_thread(uint32_t index)
+{
+    // the pool links a free stack through its first word, which is in the stack guard; the exited thread's guard is
+    // still loaded, and the next context switch loads the incoming thread's anyway. Only this path clears it: when
+    // thread_create gives back a stack it never started, the loaded guard is the caller's own
+    ARM_MPU_ClrRegion(NEO_MPU_GUARD_REGION);
+    thread_pool_free(thread_queue[index]);
+    sched_lock_depth[index] = 0; // a thread that exits holding the scheduler lock doesn't pass it on to the next user of the id
+    neo_bitmap_clear(&exited_threads_bit_mask, index);
+    thread_queue[index] = NULL;
+    neo_bitmap_set(&free_thread_ids, index);
+    thread_queue_len--;
+}
+
+// pends a context switch that preempts the running thread, or leaves it to neo_sched_unlock if the thread holds the
+// scheduler lock; switches the running thread asks for itself (blocking, sleeping, yielding) use trigger_context_switch
+// must be called with the kernel locked
+static inline void preempt_current(void)
+{
+    if (sched_lock_depth[curr_running_thread_index])
+    {
+        sched_switch_deferred = 1;
+        return;
+    }
+    trigger_context_switch();
+}
+
+// pends a context switch if a thread with a higher priority than the running one is ready
+// must be called with the kernel locked
+static inline void preempt_if_needed(void)
+{
+    if (!is_first_time && neo_most_sig_one(ready_priorities_bit_mask) > (int32_t)thread_queue[curr_running_thread_index]->priority)
+    {
+        preempt_current();
+    }
+}
+
+/*
+ * Picks the next thread in O(1), independent of the number of threads:
+ * one CLZ over ready_priorities_bit_mask finds the highest ready priority, then the two-level ready bitmap
+ * of that priority gives the next ready thread after the one picked last time (round-robin) with RBIT + CLZ
+ * on a leaf word and, when the leaf has nothing left, on the summary word
+ * The idle thread is always ready at NEO_IDLE_PRIORITY when not running, so there is always a candidate
+ */
+static inline uint32_t pick_next_thread(void)
+{
+    uint32_t priority = (uint32_t)neo_most_sig_one(ready_priorities_bit_mask);
+    uint32_t next_index = neo_bitmap_next_after(&ready_threads_bit_mask[priority], last_scheduled_at_priority[priority]);
+
+    last_scheduled_at_priority[priority] = (uint8_t)next_index;
+    return next_index;
+}
+
+// inserts the thread into the sleep queue so that it wakes up after the given number of ticks (at least one)
+// walks the queue, which is fine since it runs in the calling thread's context rather than in the tick
+// must be called with the kernel locked
+static void sleep_queue_insert(uint32_t index, uint32_t ticks)
+{
+    uint32_t prev = NEO_NO_THREAD;
+    volatile uint8_t *link = &sleep_queue_head;
+    while (*link != NEO_NO_THREAD && sleep_delta[*link] <= ticks)
+    {
+        ticks -= sleep_delta[*link];
+        prev = *link;
+        link = &sleep_next[*link];
+    }
+
+    sleep_delta[index] = ticks;
+    sleep_next[index] = *link;
+    sleep_prev[index] = (uint8_t)prev;
+    if (*link != NEO_NO_THREAD)
+    {
+        sleep_delta[*link] -= ticks; // the thread behind now wakes up relative to the inserted one
+        sleep_prev[*link] = (uint8_t)index;
+    }
+    *link = (uint8_t)index;
+}
+
+// takes the thread out of the sleep queue before its time; the thread behind it inherits its delta
+// must be called with the kernel locked
+static void sleep_queue_remove(uint32_t index)
+{
+    uint32_t next = sleep_next[index];
+    uint32_t prev = sleep_prev[index];
+    if (next != NEO_NO_THREAD)
+    {
+        sleep_delta[next] += sleep_delta[index];
+        sleep_prev[next] = (uint8_t)prev;
+    }
+    if (prev == NEO_NO_THREAD)
+    {
+        sleep_queue_head = (uint8_t)next;
+    }
+    else
+    {
+        sleep_next[prev] = (uint8_t)next;
+    }
+}
+
+// true if the thread is blocked in the given wait queue
+// a queue's head is in its object, which an unprivileged thread may have overwritten, so the kernel checks every thread
+// it reaches from a head against its own records before following it; a bad head costs the object its waiters, which
+// are left to their timeouts, but can't make the kernel write outside its own arrays
+static inline bool in_wait_queue(uint32_t index, const neo_wait_queue_t *queue)
+{
+    return index < MAX_THREADS && neo_bitmap_test(&blocked_threads_bit_mask, index) && waiting_on[index] == queue;
+}
+
+// unlinks a blocked thread from the wait queue it sits in
+// must be called with the kernel locked
+static void wait_queue_remove(uint32_t index)
+{
+    volatile uint8_t *link = &waiting_on[index]->head;
+    for (uint32_t steps = 0; *link != index; steps++)
+    {
+        if (steps == MAX_THREADS || !in_wait_queue(*link, waiting_on[index]))
+        {
+            return; // the head was overwritten and the thread can't be reached from it any more
+        }
+        link = &wait_next[*link];
+    }
+    *link = wait_next[index];
+}
+
+// wakes up every thread at the head of the sleep queue whose delta has run out
+// must be called with the kernel locked
+static inline void sleep_queue_wake_expired(void)
+{
+    uint32_t index = sleep_queue_head;
+    while (index != NEO_NO_THREAD && !sleep_delta[index])
+    {
+        if (neo_bitmap_test(&timed_threads_bit_mask, index))
+        {
+            // a wait ran out of time; the thread leaves the object it was blocked on empty-handed
+            if (waiting_on[index])
+            {
+                wait_queue_remove(index);
+            }
+            neo_bitmap_clear(&timed_threads_bit_mask, index);
+            neo_bitmap_clear(&blocked_threads_bit_mask, index);
+            wait_result[index] = NEO_WAIT_TIMEOUT;
+        }
+        else
+        {
+            neo_bitmap_clear(&sleeping_threads_bit_mask, index);
+        }
+        make_thread_ready(index);
+        index = sleep_next[index];
+    }
+    sleep_queue_head = (uint8_t)index;
+    if (index != NEO_NO_THREAD)
+    {
+        sleep_prev[index] = NEO_NO_THREAD;
+    }
+}
+
+#if NEO_TICKLESS_IDLE
+
+// returns the number of ticks until the earliest sleeping thread is due; zero if no thread is sleeping
+// must be called with the kernel locked
+static inline uint32_t ticks_until_next_wakeup(void)
+{
+    return sleep_queue_head == NEO_NO_THREAD ? 0 : sleep_delta[sleep_queue_head];
+}
+
+// accounts for ticks that passed without a SysTick interrupt, exactly as update_sleeping_threads would have
+// must be called with the kernel locked
+static void catch_up_ticks(uint32_t ticks)
+{
+    if (!ticks)
+    {
+        return;
+    }
+
+    tick_count += ticks;
 
-volatile uint32_t ready_threads_bit_mask = 0;
-volatile uint32_t new_threads_bit_mask = 0;
-volatile uint32_t sleeping_threads_bit_mask = 0;
-volatile uint32_t running_threads_bit_mask = 0;
-volatile uint32_t paused_threads_bit_mask = 0;
+    // consume the ticks from the front of the queue; only the threads that expire are touched
+    uint32_t index = sleep_queue_head;
+    while (index != NEO_NO_THREAD && ticks)
+    {
+        uint32_t step = sleep_delta[index] < ticks ? sleep_delta[index] : ticks;
+        sleep_delta[index] -= step;
+        ticks -= step;
+        if (sleep_delta[index])
+        {
+            break;
+        }
+        index = sleep_next[index];
+    }
+    sleep_queue_wake_expired();
+    preempt_if_needed();
+}
 
-volatile uint32_t thread_sleep_time[MAX_THREADS];
+// sleeps until an interrupt is pending; called with the kernel locked and returns with it locked
+// interrupts masked by BASEPRI don't wake the core from WFI, so PRIMASK stands in for the kernel lock while sleeping;
+// the interrupt that woke the core is taken once the kernel is unlocked again, with the idle bookkeeping done
+static inline void idle_wait(void)
+{
+    __disable_irq();
+    neo_kernel_unlock();
+    __DSB();
+    __asm__ volatile("wfi");
+    neo_kernel_lock();
+    __enable_irq();
+}
 
-// returns the bit number of the most significant one in num
-// if there is no one in num (i.e num is zero), it returns -1
-static inline int8_t most_sig_one(uint32_t num)
+/*
+ * Sleeps until the earliest sleep expiry with SysTick reprogrammed to cover the whole interval
+ *
+ * The current tick is finished first (whatever is left in SysTick->VAL), then whole ticks follow.
+ * On wakeup, the ticks that passed without an interrupt are added to tick_count; if the long period
+ * ran out, the pending SysTick interrupt accounts for its last tick itself. SysTick is then restarted
+ * for the rest of the tick it is in, so the tick phase is kept.
+ * SysTick is stopped for a few instructions while it's reprogrammed; an interrupt above the kernel ceiling that comes
+ * in right then delays the tick by its own run time.
+ */
+static void tickless_idle(void)
 {
-    return 31 - (int8_t)__CLZ(num);
+    neo_kernel_lock();
+
+    // a thread other than the idle thread can run; PendSV is already pending and will switch to it
+    if (ready_priorities_bit_mask)
+    {
+        neo_kernel_unlock();
+        return;
+    }
+
+    // with nothing sleeping, only an interrupt can make a thread ready; sleep as long as SysTick allows
+    uint32_t idle_ticks = ticks_until_next_wakeup();
+    if (!idle_ticks || idle_ticks > max_idle_ticks)
+    {
+        idle_ticks = max_idle_ticks;
+    }
+
+    SysTick->CTRL &= ~SysTick_CTRL_ENABLE_Msk;
+    uint32_t counts_left = SysTick->VAL;
+
+    // the next wakeup is due with the next regular tick anyway, or that tick already expired
+    if (idle_ticks < 2U || !counts_left || (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk))
+    {
+        SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+        idle_wait();
+        neo_kernel_unlock();
+#ifdef NEO_PROFILE
+        neo_idle_wakeups++;
+#endif
+        return;
+    }
+
+    uint32_t idle_counts = counts_left + (idle_ticks - 1U) * systick_counts_per_tick;
+    SysTick->LOAD = idle_counts - 1U;
+    SysTick->VAL = 0; // the counter reloads from LOAD on the next clock
+    SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+
+    idle_wait();
+
+    SysTick->CTRL &= ~SysTick_CTRL_ENABLE_Msk;
+
+    uint32_t elapsed_ticks;
+    uint32_t counts_into_tick;
+    if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk)
+    {
+        // the whole idle period passed; the counter has reloaded and keeps counting from LOAD
+        elapsed_ticks = idle_ticks - 1U; // SysTick_handler accounts for the last one
+        counts_into_tick = (idle_counts - 1U) - SysTick->VAL;
+    }
+    else
+    {
+        // another interrupt ended the idle period early
+        uint32_t elapsed_counts = idle_counts - SysTick->VAL;
+        if (elapsed_counts < counts_left)
+        {
+            elapsed_ticks = 0;
+            counts_into_tick = systick_counts_per_tick - (counts_left - elapsed_counts);
+        }
+        else
+        {
+            elapsed_counts -= counts_left;
+            elapsed_ticks = 1U + elapsed_counts / systick_counts_per_tick;
+            counts_into_tick = elapsed_counts % systick_counts_per_tick;
+        }
+    }
+
+    // restart SysTick for the rest of the current tick, then from the next reload onwards with the regular period
+    uint32_t counts_to_next_tick = systick_counts_per_tick - counts_into_tick;
+    if (counts_into_tick >= systick_counts_per_tick || counts_to_next_tick < 2U)
+    {
+        counts_to_next_tick = 2U; // SysTick doesn't count with a LOAD of zero
+    }
+    SysTick->LOAD = counts_to_next_tick - 1U;
+    SysTick->VAL = 0;
+    SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+    SysTick->LOAD = systick_counts_per_tick - 1U; // only used from the next reload on
+
+    catch_up_ticks(elapsed_ticks);
+#ifdef NEO_PROFILE
+    neo_idle_wakeups++;
+#endif
+    neo_kernel_unlock();
 }
 
+#endif // NEO_TICKLESS_IDLE
+
 void idle_thread_function(void)
 {
     while (true)
     {
+#if NEO_TICKLESS_IDLE
+        tickless_idle();
+#else
         /* The CPU goes into sleep mode and wakes up when an interrupt occurs */
         __asm__ volatile("wfi");
+#ifdef NEO_PROFILE
+        neo_idle_wakeups++;
+#endif
+#endif
     }
 }
 
@@ -90,19 +568,48 @@ void idle_thread_function(void)
  */
 void neo_kernel_init(void)
 {
-    __disable_irq();
-    setup_systick(TIME_SLICE_MS); // Configure system tick for thread time slicing
+    neo_kernel_lock();
+    setup_systick(NEO_TICK_MS); // Configure system tick for timekeeping and thread time slicing
+#if NEO_TICKLESS_IDLE
+    systick_counts_per_tick = SysTick->LOAD + 1U;
+    max_idle_ticks = SysTick_LOAD_RELOAD_Msk / systick_counts_per_tick;
+#endif
 
     NVIC_EnableIRQ(PendSV_IRQn); // Enable PendSV for context switching
     // setting PendSV to the lowest priority; this is so that context switch happens when all interrupts are done
     NVIC_SetPriority(PendSV_IRQn, LOWEST_PRIORITY); // setting priority to 0xFF; it will still be set to 0xF0 since STM32 only implements 4 MSB bits for priority
-    // by default, the priority of SysTick is set to 0x00; we set it here manually anyway
-    NVIC_SetPriority(SysTick_IRQn, 0x00); // setting priority to 0x00
+    // SysTick and SVCall run kernel code, so they sit at the kernel ceiling; the priorities above it are never masked by the kernel
+    // an SVC is only ever made from thread mode with the kernel unlocked, so BASEPRI never holds it off
+    NVIC_SetPriority(SysTick_IRQn, NEO_KERNEL_CEILING);
+    NVIC_SetPriority(SVCall_IRQn, NEO_KERNEL_CEILING);
+
+#ifdef NEO_PROFILE
+    neo_profile_init();
+#endif
+
+    neo_mpu_init();
+    neo_clock_init();
 
     thread_queue[MAX_THREADS] = &idle_thread;
     idle_thread.thread_id = MAX_THREADS;
+    idle_thread.priority = NEO_IDLE_PRIORITY;
+    idle_thread.base_priority = NEO_IDLE_PRIORITY;
+    idle_thread.unprivileged = 0; // the idle thread drives SysTick and locks the kernel itself
+
+    for (uint32_t index = 0; index < MAX_THREADS; index++)
+    {
+        neo_bitmap_set(&free_thread_ids, index);
+        neo_wait_queue_init(&join_waiters[index]);
+    }
+
+    // start every round-robin cursor at the last thread id so that the first pick at each priority is the lowest ready thread index
+    for (volatile uint32_t priority = 0; priority < NEO_PRIORITY_LEVELS; priority++)
+    {
+        last_scheduled_at_priority[priority] = NEO_BITMAP_BITS - 1U;
+    }
 
-    ready_threads_bit_mask |= 1U << idle_thread.thread_id;
+    make_thread_ready(idle_thread.thread_id);
+    neo_mpu_stack_guard((uint8_t *)idle_thread_stack, sizeof(idle_thread_stack), (ARM_MPU_Region_t *)&idle_thread.mpu_guard);
     uint8_t *aligned_top = (uint8_t *)(((uintptr_t)idle_thread_stack + IDLE_THREAD_STACK_SIZE_IN_32_BITS * 4) & ~(STACK_ALIGNMENT - 1));
 
     // Use temporary pointer to build stack frame
@@ -116,6 +623,7 @@ void neo_kernel_init(void)
     *(--ptr) = 0;                              // R2
     *(--ptr) = 0;                              // R1
     *(--ptr) = 0;                              // R0
+    *(--ptr) = EXC_RETURN_THREAD_PSP;          // EXC_RETURN (from core_cm4.h); process stack, basic frame
 
     // Initialize callee-saved registers
     for (volatile int i = 0; i < 8; i++)
@@ -126,14 +634,17 @@ void neo_kernel_init(void)
     // Only now set the thread's stack pointer to the final position
     idle_thread.stack_ptr = (uint8_t *)ptr;
 
+    thread_pool_init();
+
     // initialize the heap
     neo_heap_init();
-    __enable_irq();
+    neo_kernel_unlock();
 }
 
 /**
  * @brief Thread system timer handler
  * Manages thread time slicing and triggers context switches
+ * Also preempts the running thread when a thread of higher priority was woken up during this tick
  * NOTE: naked attribute prevents compiler from generating prologue/epilogue
  */
 __attribute__((naked)) void thread_handler(void)
@@ -141,8 +652,8 @@ __attribute__((naked)) void thread_handler(void)
     // interrupts are already disabled when this function enters
     // we will not save the registers r4 to r11 of the current thread in this function; we will save them in the PendSV handler; so we can't clobber them in this function
     // we can save them in this function though; but we will not do that
-    /* we can do regular function calls from this using bl instead of just branching there with b by first saving lr on stack then popping it after the return; we aren't doing that though */
-    /* so any of the branches shouldn't use bl to call functions or lr will get clobbered */
+    /* regular function calls (bl) are made by first saving lr on stack and popping it after the return; any other branch must not use bl or lr will get clobbered */
+    /* configuration values and structure offsets are passed in as immediate operands, so nothing here has to be edited by hand */
     __asm__ volatile(
         ".extern exit_from_interrupt_\n"
 
@@ -157,21 +668,49 @@ __attribute__((naked)) void thread_handler(void)
         "cmp r2, #1\n"
         "beq first_time_thread_handler\n"
 
-        // update sleeping threads
-        "b update_sleeping_threads \n"
-        "return_from_update: \n"
+        // update sleeping threads; a regular function call, so lr (EXC_RETURN) is saved around it
+        "push {r4, lr} \n" // r4 only keeps the stack 8-byte aligned
+        "bl update_sleeping_threads \n"
+        "pop {r4, lr} \n"
 
         // Load tick values and check time slice expiration
         "ldr r0, =tick_count\n"
         "ldr r1, [r0]\n" // Current tick in r1
         "ldr r0, =last_thread_start_tick\n"
         "ldr r0, [r0]\n"   // Last start tick in r0
-        "sub r1, r1, r0\n" // Calculate elapsed ticks
-                           // HARDCODED ALERT: Update this value if TIME_SLICE_TICKS changes
-        "cmp r1, #10\n"    // Compare against TIME_SLICE_TICKS
-        "blt thread_time_slice_not_expired\n"
+        "sub r1, r1, r0\n"                   // Calculate elapsed ticks
+        "ldr r0, =%c[time_slice_ticks]\n" // TIME_SLICE_TICKS needn't fit an immediate operand
+        "cmp r1, r0\n"
+        "bge preempt_running_thread\n"
+
+        // Preempt if the highest ready priority is above the running thread's priority
+        "ldr r0, =ready_priorities_bit_mask\n"
+        "ldr r0, [r0]\n"
+        "clz r0, r0\n"
+        "rsb r0, r0, #31\n" // Highest ready priority; -1 if nothing is ready
+        "ldr r1, =curr_running_thread_index\n"
+        "ldr r1, [r1]\n"
+        "ldr r2, =thread_queue\n"
+        "ldr r1, [r2, r1, lsl #2]\n"
+        "ldrb r1, [r1, %[priority_offset]]\n" // Running thread's priority
+        "cmp r0, r1\n"
+        "ble thread_time_slice_not_expired\n"
+
+        // The running thread is due to be switched out; if it holds the scheduler lock, it keeps the CPU and
+        // neo_sched_unlock makes the switch instead
+        "preempt_running_thread:\n"
+        "ldr r0, =curr_running_thread_index\n"
+        "ldr r0, [r0]\n"
+        "ldr r1, =sched_lock_depth\n"
+        "ldrb r1, [r1, r0]\n"
+        "cbz r1, first_time_thread_handler\n"
+        "ldr r0, =sched_switch_deferred\n"
+        "movs r1, #1\n"
+        "str r1, [r0]\n"
+        "b thread_time_slice_not_expired\n"
 
-        "first_time_thread_handler:\n");
+        "first_time_thread_handler:\n" ::[time_slice_ticks] "i"(TIME_SLICE_TICKS),
+        [priority_offset] "i"(offsetof(neo_thread_t, priority)));
 
     // Trigger PendSV exception for context switch
     SCB->ICSR |= (1U << (2 * PENDSV_IRQ_NUM)); // will be done just using r0 to r3
@@ -180,7 +719,7 @@ __attribute__((naked)) void thread_handler(void)
         "threads_not_started:\n"
         "thread_time_slice_not_expired:\n"
         "b exit_from_interrupt_\n");
-    // interrupts are enabled when this function exits
+    // SysTick runs at the kernel ceiling, so nothing that touches the kernel preempts this function
 }
 
 /**
@@ -198,164 +737,163 @@ __attribute__((naked)) void PendSV_handler(void)
     /* we need to save lr before calling context switch (or any other function) since we can't afford to clobber lr as it contains the original EXC_RETURN and we haven't saved lr at the start of the
     function which would also be incorrect since we switch stacks in this function and popping lr at the last would be incorrect */
     __asm__ volatile(
+        // lock the kernel; interrupts above the kernel ceiling can still come in during the switch
+        "mov r0, %[kernel_basepri]\n"
+        "msr basepri, r0\n"
+        "isb\n"
+
         // Check if context save is needed
-        "cpsid i\n"
         "ldr r0, =is_first_time\n"
         "ldr r0, [r0]\n"
         "cmp r0, #1\n"
         "beq skip_save\n"
 
-        // Save registers R4-R11 (callee-saved registers)
-        "stmdb sp!, {r4-r11}\n"
+        // threads run on the process stack (PSP) while this handler runs on the main stack (MSP)
+        // the hardware has stacked the thread's exception frame on PSP; the rest of its context goes there too
+        "mrs r0, psp\n"
+
+        // EXC_RETURN bit 4 is clear if the thread has used the FPU (CONTROL.FPCA was set) and the hardware reserved an extended frame
+        // only then save the callee-saved FPU registers S16-S31; with lazy stacking enabled, this store also makes the
+        // hardware write the caller-saved S0-S15 and FPSCR into the space it reserved on exception entry
+        "tst lr, #0x10\n"
+        "it eq\n"
+        "vstmdbeq r0!, {s16-s31}\n"
+
+        // Save registers R4-R11 (callee-saved registers) and EXC_RETURN, which differs between FPU and non-FPU threads
+        "stmdb r0!, {r4-r11, lr}\n"
+
+        // Save current thread's PSP
+        "ldr r2, =thread_queue\n"
+        "ldr r3, =curr_running_thread_index\n"
+        "ldr r3, [r3]\n"
+        "ldr r1, [r2, r3, lsl #2]\n"
+        "str r0, [r1]\n" // stack_ptr is first element
 
-        /* we have now saved the registers r4 to r11; we can clobber them in the subsequent function calls */
+        /* we have now saved the registers r4 to r11 and lr; we can clobber them in the subsequent function calls */
 
         "skip_save:\n"
         // we now schedule which thread to run next
-        "b neo_thread_scheduler\n"
-        "return_from_scheduler:\n"
+        // the scheduler is a regular function called with bl; lr is restored from the next thread's saved context
+        "bl neo_thread_scheduler\n"
         // actual context switch happens from here in the neo_context_switch function
         "b neo_context_switch\n"
 
         "switch:\n"
-        // Restore callee-saved registers
-        "ldmia sp!, {r4-r11}\n"
-        "cpsie i\n" // enable interrupts again
-        "bx lr\n");
+        "mov r0, #0\n"
+        "msr basepri, r0\n" // unlock the kernel again
+        "bx lr\n" ::[kernel_basepri] "i"(NEO_KERNEL_BASEPRI));
 }
 
 /**
  * @brief Performs the actual context switch between threads
- * Handles stack pointer updates and thread state transitions
+ * Restores the next thread's context from its stack and points PSP at it
  */
 __attribute__((naked)) void neo_context_switch(void)
 {
-    /* we have now saved the registers r4 to r11; we can clobber them */
-    /* interrupts are disabled before entering this function */
+    /* the outgoing thread's context (r4 to r11, lr and, for FPU threads, s16 to s31) is already saved on its PSP */
+    /* the kernel is locked (BASEPRI at the kernel ceiling) before entering this function */
 
     /* should have no bl instruction for calls */
 
     __asm__ volatile(
-        // Check first time switch (using r3 since we don't need thread_queue_len anymore)
+        // Check first time switch
         "ldr r3, =is_first_time\n"
         "ldr r3, [r3]\n"
         "cmp r3, #1\n"
-        "beq 1f\n" // Local forward reference instead of label
+        "bne 1f\n" // Local forward reference instead of label
 
-        // Save current thread's SP
-        "ldr r2, =thread_queue\n" // Load queue base into r2
-        "ldr r3, =last_running_thread_index\n"
-        "ldr r3, [r3]\n"
-        "ldr r0, [r2, r3, lsl #2]\n" // Use indexed addressing mode
-        "str sp, [r0]\n"             // Store SP directly - stack_ptr is first element
-
-        "1:\n" // first_time_switch
-        // Load new thread's SP
-        "ldr r2, =thread_queue\n" // r2 already has this if not first time
-        "ldr r3, =curr_running_thread_index\n"
-        "ldr r3, [r3]\n"
-        "ldr r0, [r2, r3, lsl #2]\n" // Use indexed addressing mode
-        "ldr sp, [r0]\n"             // Load SP directly - stack_ptr is first element
+        // main() never runs again, so its frames on MSP are dead; hand the whole main stack over to the handlers
+        "ldr r0, =_estack\n"
+        "msr msp, r0\n"
 
-        // Clear first time flag - only need one register now
+        // Clear first time flag
         "ldr r0, =is_first_time\n"
         "mov r3, #0\n"
         "str r3, [r0]\n"
 
-        "2:\n"
-        "b switch\n" ::: "r0", "r2", "r3", "memory" // Updated clobber list
-    );
+        "1:\n"
+        // Load new thread's PSP
+        "ldr r2, =thread_queue\n"
+        "ldr r3, =curr_running_thread_index\n"
+        "ldr r3, [r3]\n"
+        "ldr r0, [r2, r3, lsl #2]\n" // Use indexed addressing mode
+
+        // copy the thread's privilege level into CONTROL.nPRIV; it takes effect in Thread mode after the exception return
+        "ldrb r1, [r0, %[unprivileged_offset]]\n"
+        "mrs r2, control\n"
+        "bfi r2, r1, #0, #1\n"
+        "msr control, r2\n"
+
+        // move the stack guard region below the thread's stack; RBAR selects the region, RASR follows it in the register map
+        "add r1, r0, %[mpu_guard_offset]\n"
+        "ldmia r1, {r1, r2}\n"
+        "ldr r3, =%c[mpu_rbar]\n"
+        "stmia r3, {r1, r2}\n"
+
+        "ldr r0, [r0]\n" // stack_ptr is first element
+
+        // Restore callee-saved registers and the thread's own EXC_RETURN
+        "ldmia r0!, {r4-r11, lr}\n"
+        // Restore S16-S31 only for a thread that was using the FPU when it was switched out (EXC_RETURN bit 4 clear)
+        "tst lr, #0x10\n"
+        "it eq\n"
+        "vldmiaeq r0!, {s16-s31}\n"
+
+        // the exception return unstacks the rest from PSP and, since EXC_RETURN selects PSP, keeps the thread on it
+        "msr psp, r0\n"
+
+        "b switch\n" ::[unprivileged_offset] "i"(offsetof(neo_thread_t, unprivileged)),
+        [mpu_guard_offset] "i"(offsetof(neo_thread_t, mpu_guard)),
+        [mpu_rbar] "i"(MPU_BASE + offsetof(MPU_Type, RBAR)) : "r0", "r1", "r2", "r3", "memory");
 }
 
 /**
  * @brief Bare metal thread scheduler implementation
  *
- * This function implements a round-robin scheduler with support for thread states
- * and idle thread handling. It runs with interrupts disabled and uses naked attribute
- * to manage its own stack frame.
+ * This function implements a fixed-priority preemptive scheduler with round-robin
+ * among threads of equal priority and idle thread handling. It runs with the kernel
+ * locked and is called with bl from PendSV_handler.
  *
  * Key Features:
- * - Round-robin scheduling policy
- * - Support for READY and RUNNING thread states
+ * - O(1) selection; the cost does not depend on the number of threads (see pick_next_thread)
+ * - Highest ready priority always runs
+ * - Round-robin among ready threads of the same priority
  * - Idle thread fallback when no threads are ready
- * - First-time initialization handling
  *
- * @note This function is marked as naked and should only be called from assembly
  * @note Registers r4-r11 are already saved before entering this function
- * @note Interrupts are disabled when entering this function
+ * @note The kernel is locked when entering this function
  */
-
-__attribute__((naked)) void neo_thread_scheduler(void)
+__attribute__((used)) void neo_thread_scheduler(void)
 {
-    // this function is called with interrupts disabled
-    /* Handle first-time scheduling initialization */
-
-    /* should have no bl instruction for calls */
-    if (is_first_time)
-    {
-        /* Start with the first thread (index 0) */
-        curr_running_thread_index = 0;
-
-        /* If thread 0 isn't ready, find the first ready thread */
-        if (!(ready_threads_bit_mask & (1U << 0)))
-        {
-            uint32_t ready_bits = ready_threads_bit_mask & ~(1U << MAX_THREADS);
-            if (ready_bits)
-            {
-                uint32_t clz_result;
-                __asm__ volatile("clz %0, %1" : "=r"(clz_result) : "r"(ready_bits));
-                curr_running_thread_index = 31 - (uint32_t)clz_result;
-            }
-            else
-            {
-                curr_running_thread_index = MAX_THREADS; // Idle thread
-            }
-        }
-
-        goto enable_and_return;
-    }
-
-    /* Main scheduling logic */
-    last_running_thread_index = curr_running_thread_index;
+    // this function is called with the kernel locked
+    NEO_PROFILE_START(start_cycles);
 
-    /* Update previous thread state if it was running */
-    if (running_threads_bit_mask & (1U << last_running_thread_index))
+    if (!is_first_time)
     {
-        running_threads_bit_mask &= ~(1U << last_running_thread_index);
-        ready_threads_bit_mask |= 1U << last_running_thread_index;
-    }
-
-    /* Simple round-robin: try next thread index */
-    uint32_t next_index = (last_running_thread_index + 1) % MAX_THREADS;
-    uint32_t start_index = next_index;
+        last_running_thread_index = curr_running_thread_index;
 
-    /* Search for next ready thread in round-robin fashion */
-    while (!(ready_threads_bit_mask & (1U << next_index)))
-    {
-        next_index++;
-        if (next_index == MAX_THREADS)
+        /* Update previous thread state if it was running; it competes with the other ready threads again */
+        if (neo_bitmap_test(&running_threads_bit_mask, last_running_thread_index))
         {
-            next_index = 0;
+            neo_bitmap_clear(&running_threads_bit_mask, last_running_thread_index);
+            make_thread_ready(last_running_thread_index);
         }
-
-        /* If we've checked all threads, use idle thread */
-        if (next_index == start_index)
+        else if (neo_bitmap_test(&exited_threads_bit_mask, last_running_thread_index))
         {
-            next_index = MAX_THREADS;
-            break;
+            // its context was just saved for the last time; nothing refers to the thread any more
+            release_thread(last_running_thread_index);
         }
     }
 
-    curr_running_thread_index = next_index;
+    curr_running_thread_index = pick_next_thread();
 
-enable_and_return:
     /* Update thread state and timing information */
-    running_threads_bit_mask = 1U << curr_running_thread_index;
-    ready_threads_bit_mask &= ~(1U << curr_running_thread_index);
+    neo_bitmap_set(&running_threads_bit_mask, curr_running_thread_index);
+    make_thread_unready(curr_running_thread_index);
     last_thread_start_tick = tick_count;
+    sched_switch_deferred = 0; // whatever switch was owed has just been made
 
-    /* Return to assembly context switch code */
-    __asm__ volatile("b return_from_scheduler");
+    NEO_PROFILE_END(neo_scheduler_profile, start_cycles);
 }
 
 /**
@@ -363,30 +901,53 @@ enable_and_return:
  * @param thread Pointer to thread structure
  * @param thread_function Thread entry point function
  * @param thread_arg Argument passed to thread function
- * @param stack Pointer to thread's stack memory
- * @param stack_size Size of stack in bytes
+ * @param stack Pointer to thread's stack memory; its bottom is turned into an MPU guard (see NEO_THREAD_STACK)
+ * @param stack_size Size of stack in bytes, guard included
+ * @param priority Scheduling priority, from NEO_MIN_PRIORITY (lowest) to NEO_MAX_PRIORITY (highest)
  * @return true if initialization successful, false otherwise
+ * @note The thread runs unprivileged; see neo_thread_set_privileged
+ * @note Only privileged code can create threads; an unprivileged caller gets false
+ * @note The thread structure must be in kernel RAM (NEO_KERNEL_BSS), since the kernel trusts what it holds; the stack
+ * must be outside it unless the thread is made privileged before it starts
  */
 bool neo_thread_init(neo_thread_t *thread, void (*thread_function)(void *),
-                     void *thread_arg, uint8_t *stack, uint32_t stack_size)
+                     void *thread_arg, uint8_t *stack, uint32_t stack_size, uint8_t priority)
 {
     // Validate parameters
-    if (!thread || !thread_function || !stack)
+    if (!neo_in_privileged_context() || !thread || !thread_function || !stack || priority < NEO_MIN_PRIORITY || priority > NEO_MAX_PRIORITY)
+    {
+        return false;
+    }
+    if (!neo_mpu_in_kernel_ram(thread, sizeof(*thread)))
+    {
+        return false; // an unprivileged thread could rewrite its id, priority or privilege
+    }
+
+    // the guard has to leave room for at least the initial context
+    ARM_MPU_Region_t guard;
+    uint8_t *stack_bottom = neo_mpu_stack_guard(stack, stack_size, &guard);
+    if (!stack_bottom || (uintptr_t)stack + stack_size < (uintptr_t)stack_bottom + MIN_STACK_SIZE)
     {
         return false;
     }
 
     // Check thread limit
-    __disable_irq();
-    if (thread_queue_len >= MAX_THREADS)
+    neo_kernel_lock();
+    if (neo_bitmap_is_empty(&free_thread_ids))
     {
-        __enable_irq();
+        neo_kernel_unlock();
         return false;
     }
 
-    // Add thread to queue
-    thread->thread_id = thread_queue_len;
-    thread_queue[thread_queue_len++] = thread;
+    // Add thread to queue, in the lowest free slot
+    thread->thread_id = neo_bitmap_lowest(&free_thread_ids);
+    neo_bitmap_clear(&free_thread_ids, thread->thread_id);
+    thread_queue_len++;
+    thread->priority = priority;
+    thread->base_priority = priority;
+    thread->unprivileged = 1;
+    thread->mpu_guard = guard;
+    thread_queue[thread->thread_id] = thread;
 
     // Align stack pointer to 8-byte boundary (AAPCS requirement)
     thread->stack_ptr = (uint8_t *)(((uintptr_t)stack + stack_size) & ~(STACK_ALIGNMENT - 1));
@@ -398,21 +959,29 @@ bool neo_thread_init(neo_thread_t *thread, void (*thread_function)(void *),
      * Stack layout (from high to low address):
      * - xPSR: Program Status Register (Thumb bit set)
      * - PC: Program Counter (thread_function)
-     * - LR: Link Register (unused as thread shouldn't return)
+     * - LR: Link Register; neo_thread_exit, so returning from the thread function exits the thread
      * - R12: General Purpose Register
      * - R3-R1: Parameter Registers (unused)
      * - R0: First Parameter Register (thread_arg)
+     * - EXC_RETURN: restored into lr by the context switch; bit 4 tells it whether S16-S31 follow
      * - R11-R4: Callee-saved Registers
+     *
+     * A thread that uses the FPU needs 34 more words of stack once it is switched out:
+     * 18 for the extended exception frame (S0-S15, FPSCR, reserved) and 16 for S16-S31
+     *
+     * Threads run on PSP and every handler runs on MSP, so beyond this one exception frame and the
+     * saved context the stack only has to hold the thread's own usage; nested interrupts never land on it
      */
 
     *(--ptr) = 0x01000000;                // xPSR (Thumb bit)
     *(--ptr) = (uint32_t)thread_function; // PC
-    *(--ptr) = 0;                         // LR
+    *(--ptr) = (uint32_t)neo_thread_exit; // LR
     *(--ptr) = 0;                         // R12
     *(--ptr) = 0;                         // R3
     *(--ptr) = 0;                         // R2
     *(--ptr) = 0;                         // R1
     *(--ptr) = (uint32_t)thread_arg;      // R0
+    *(--ptr) = EXC_RETURN_THREAD_PSP;     // EXC_RETURN (from core_cm4.h); process stack, basic frame
 
     // Initialize callee-saved registers
     for (volatile int i = 0; i < 8; i++) // without volatile, memset is used which I have not defined
@@ -421,32 +990,61 @@ bool neo_thread_init(neo_thread_t *thread, void (*thread_function)(void *),
     }
 
     thread->stack_ptr = (uint8_t *)ptr;
-    new_threads_bit_mask |= 1U << thread->thread_id;
-    __enable_irq(); // enable interrupts only after the thread has been initialized
+    neo_bitmap_set(&new_threads_bit_mask, thread->thread_id);
+    neo_kernel_unlock(); // enable interrupts only after the thread has been initialized
+    return true;
+}
+
+/**
+ * @brief Let a thread run privileged (or unprivileged again)
+ * Privileged threads call the kernel directly instead of through SVC and may access the System Control Space;
+ * meant for trusted driver or kernel service threads. Takes effect the next time the thread is switched in
+ * A privileged thread's stack must be in kernel RAM (NEO_KERNEL_BSS), or unprivileged threads could rewrite its saved
+ * context; an unprivileged thread's stack must be outside it, or its first exception would fault
+ * @param thread Pointer to an initialized thread structure that isn't running
+ * @param privileged true to run the thread privileged
+ * @return true if the privilege level was changed, false if the caller is unprivileged itself or the thread's stack is
+ * in the wrong place
+ */
+bool neo_thread_set_privileged(neo_thread_t *thread, bool privileged)
+{
+    if (!neo_in_privileged_context() || !thread)
+    {
+        return false;
+    }
+
+    // the stack runs from the guard up past the saved stack pointer; kernel RAM is the top of SRAM, so a stack whose
+    // guard is in kernel RAM lies in it entirely, and one whose saved stack pointer is below it doesn't reach it
+    uintptr_t guard_base = thread->mpu_guard.RBAR & MPU_RBAR_ADDR_Msk;
+    if (privileged ? !neo_mpu_in_kernel_ram((void *)guard_base, NEO_MPU_GUARD_SIZE) : neo_mpu_in_kernel_ram(thread->stack_ptr, 1U))
+    {
+        return false;
+    }
+    thread->unprivileged = !privileged;
     return true;
 }
 
 /**
  * @brief Start a new thread
  * Doesn't actually start the thread as in the thread starts executing; it just changes its state to READY
- * The thread will start executing when it's scheduled
+ * The thread will start executing when it's scheduled; right away if it has a higher priority than the running thread
  * @param thread Pointer to thread structure
  * @return true if thread was started, false otherwise
  */
-__attribute__((naked)) bool neo_thread_start(neo_thread_t *thread)
+bool neo_sys_thread_start(neo_thread_t *thread)
 {
-    __asm__ volatile("cpsid i \n");
+    neo_kernel_lock();
     has_threads_started = 1;
-    if (new_threads_bit_mask & (1U << thread->thread_id))
+    if (neo_kernel_is_thread(thread) && neo_bitmap_test(&new_threads_bit_mask, thread->thread_id)) // the id may belong to another thread once this one has exited
     {
-        ready_threads_bit_mask |= 1U << thread->thread_id;
-        __asm__ volatile("cpsie i \n"
-                         "mov r0, #1 \n" // return true if thread was new and we started it
-                         "bx lr \n");
+        neo_bitmap_clear(&new_threads_bit_mask, thread->thread_id);
+        make_thread_ready(thread->thread_id);
+        preempt_if_needed();
+        neo_kernel_unlock();
+        return true; // return true if thread was new and we started it
     }
-    __asm__ volatile("cpsie i \n"
-                     "mov r0, #0 \n" // return false otherwise since the thread was not new to begin with
-                     "bx lr \n");
+    neo_kernel_unlock();
+    return false; // return false otherwise since the thread was not new to begin with
 }
 
 /**
@@ -454,40 +1052,40 @@ __attribute__((naked)) bool neo_thread_start(neo_thread_t *thread)
  * Changes the state of all new threads to READY
  * Threads will start executing when they are scheduled
  */
-void neo_thread_start_all_new(void)
+void neo_sys_thread_start_all_new(void)
 {
-    __disable_irq();
-    int8_t index;
-    while ((index = most_sig_one(new_threads_bit_mask)) != -1) // efficient way to find the ready threads
+    neo_kernel_lock();
+    int32_t index;
+    while ((index = neo_bitmap_highest(&new_threads_bit_mask)) != -1) // efficient way to find the new threads
     {
-        ready_threads_bit_mask |= 1U << index;  // add the thread to the ready threads
-        new_threads_bit_mask &= ~(1U << index); // remove the thread from the new threads
+        make_thread_ready(index);                       // add the thread to the ready threads of its priority
+        neo_bitmap_clear(&new_threads_bit_mask, index); // remove the thread from the new threads
     }
     has_threads_started = 1;
-    __enable_irq();
+    preempt_if_needed();
+    neo_kernel_unlock();
 }
 
 /**
  * @brief Resume a paused thread
  * Doesn't actually resume the thread as in the thread starts executing again; it just changes its state to READY
- * The thread will come back to life when it's scheduled again
+ * The thread will come back to life when it's scheduled again; right away if it has a higher priority than the running thread
  * @param thread Pointer to thread structure
  * @return true if thread was paused and resumed, false otherwise
  */
-__attribute__((naked)) bool neo_thread_resume(neo_thread_t *thread)
+bool neo_sys_thread_resume(neo_thread_t *thread)
 {
-    __asm__ volatile("cpsid i \n");
-    if (paused_threads_bit_mask & (1U << thread->thread_id))
+    neo_kernel_lock();
+    if (neo_kernel_is_thread(thread) && neo_bitmap_test(&paused_threads_bit_mask, thread->thread_id))
     {
-        ready_threads_bit_mask |= 1U << thread->thread_id;
-        paused_threads_bit_mask &= ~(1U << thread->thread_id);
-        __asm__ volatile("cpsie i \n"
-                         "mov r0, #1 \n" // return true if thread was paused and we resumed it
-                         "bx lr \n");
+        neo_bitmap_clear(&paused_threads_bit_mask, thread->thread_id);
+        make_thread_ready(thread->thread_id);
+        preempt_if_needed();
+        neo_kernel_unlock();
+        return true; // return true if thread was paused and we resumed it
     }
-    __asm__ volatile("cpsie i \n"
-                     "mov r0, #0 \n" // return false otherwise since the thread was not paused to begin with
-                     "bx lr \n");
+    neo_kernel_unlock();
+    return false; // return false otherwise since the thread was not paused to begin with
 }
 
 /**
@@ -495,79 +1093,763 @@ __attribute__((naked)) bool neo_thread_resume(neo_thread_t *thread)
  * Pauses the current thread and triggers a context switch
  * The thread is paused until it's manually resumed
  */
-__attribute__((naked)) void neo_thread_pause(void)
+void neo_sys_thread_pause(void)
 {
-    __asm__ volatile("cpsid i \n");
-    paused_threads_bit_mask |= 1U << curr_running_thread_index;
-    ready_threads_bit_mask &= ~(1U << curr_running_thread_index);
-    running_threads_bit_mask &= ~(1U << curr_running_thread_index);
-    SCB->ICSR |= (1U << (2 * PENDSV_IRQ_NUM));
-    __asm__ volatile("cpsie i \n"
-                     "bx lr \n");
+    neo_kernel_lock();
+    // the running thread is not in any ready set; it only has to leave the running state
+    neo_bitmap_set(&paused_threads_bit_mask, curr_running_thread_index);
+    neo_bitmap_clear(&running_threads_bit_mask, curr_running_thread_index);
+    trigger_context_switch();
+    neo_kernel_unlock(); // the pended PendSV is taken right here, or as soon as SVCall_handler returns
 }
 
-__attribute__((naked)) void update_sleeping_threads()
+/**
+ * @brief Exit the running thread
+ * Wakes every thread joining it; the thread never runs again and its id is released by the scheduler once it has
+ * switched away from it, so the slot can be reused by neo_thread_init. The thread's stack and structure belong
+ * to the caller again once neo_thread_join has returned true
+ * @note Mutexes the thread still holds are not released
+ */
+void neo_sys_thread_exit(void)
 {
-    __asm__ volatile(
-        // Load addresses of key variables
-        "push {r4, r5, r6} \n" // Save registers we'll use
-        "ldr r0, =sleeping_threads_bit_mask \n"
-        "ldr r1, =thread_sleep_time \n"
-        "ldr r2, =ready_threads_bit_mask \n"
-        "mov r6, #0 \n" // Initialize loop counter
-
-        "check_thread: \n"
-        "cmp r6, #10 \n" // Check if we've processed all possible threads
-        "beq done \n"
-
-        // Check if this thread is sleeping
-        "ldr r3, [r0] \n" // Load sleeping mask
-        "mov r4, #1 \n"
-        "lsl r4, r4, r6 \n" // Create bit mask for current thread
-        "tst r3, r4 \n"     // Test if thread is sleeping
-        "beq next_thread \n"
-
-        // Decrement sleep time
-        "lsl r5, r6, #2 \n"   // r5 = thread_index * 4
-        "ldr r3, [r1, r5] \n" // Load sleep time
-        "sub r3, r3, #1 \n"   // Decrement
-        "str r3, [r1, r5] \n" // Store updated time
-
-        // Check if sleep completed
-        "cmp r3, #0 \n"
-        "bne next_thread \n"
-
-        // Wake up thread
-        "ldr r3, [r0] \n"   // Load sleeping mask
-        "bic r3, r3, r4 \n" // Clear sleeping bit
-        "str r3, [r0] \n"   // Update sleeping mask
-
-        "ldr r3, [r2] \n"   // Load ready mask
-        "orr r3, r3, r4 \n" // Set ready bit
-        "str r3, [r2] \n"   // Update ready mask
-
-        "next_thread: \n"
-        "add r6, r6, #1 \n" // Increment thread counter
-        "b check_thread \n"
-
-        "done: \n"
-        "pop {r4, r5, r6} \n" // Restore registers
-        "b return_from_update \n");
-}
-
-/* A subtle problem is that the thread calling sleep gets context switched just before the call; this can lead to the thread waiting more than expected; fundamental flaw */
-__attribute__((naked)) void neo_thread_sleep(uint32_t time)
-{
-    // time is in multiple of 100ms
-    __asm__ volatile("cpsid i \n");
-    // set the thread state to SLEEPING; everytime systick interrupt occurs, all threads that are SLEEPING have their sleep_time decremented by 1
-    sleeping_threads_bit_mask |= 1U << curr_running_thread_index;
-    ready_threads_bit_mask &= ~(1U << curr_running_thread_index);
-    running_threads_bit_mask &= ~(1U << curr_running_thread_index);
-    // set the sleep time of the thread
-    thread_sleep_time[curr_running_thread_index] = time;
-    // trigger context switch
-    SCB->ICSR |= (1U << (2 * PENDSV_IRQ_NUM));
-    __asm__ volatile("cpsie i \n"
-                     "bx lr \n");
-}
\ No newline at end of file
+    neo_kernel_lock();
+    uint32_t index = curr_running_thread_index;
+    neo_bitmap_set(&exited_threads_bit_mask, index);
+    neo_bitmap_clear(&running_threads_bit_mask, index);
+    while (neo_kernel_wake_one(&join_waiters[index]) != NEO_NO_THREAD)
+    {
+    }
+    trigger_context_switch();
+    neo_kernel_unlock(); // the pended PendSV is taken right here, or as soon as SVCall_handler returns
+}
+
+/**
+ * @brief Wait for a thread to exit
+ * @param thread Pointer to thread structure
+ * @param timeout Milliseconds to wait; 0 only checks, NEO_WAIT_FOREVER waits as long as it takes
+ * @return NEO_WAIT_OK if the thread has exited, NEO_WAIT_TIMEOUT if it hasn't and timeout is zero (or the caller
+ * is the thread itself), NEO_WAIT_PENDING if the caller was blocked
+ */
+uint32_t neo_sys_thread_join(neo_thread_t *thread, uint32_t timeout)
+{
+    neo_kernel_lock();
+    if (!neo_kernel_is_thread(thread) || neo_bitmap_test(&exited_threads_bit_mask, thread->thread_id))
+    {
+        // exited, and possibly released already
+        neo_kernel_unlock();
+        return NEO_WAIT_OK;
+    }
+    uint32_t index = thread->thread_id;
+    if (!timeout || index == curr_running_thread_index)
+    {
+        neo_kernel_unlock();
+        return NEO_WAIT_TIMEOUT;
+    }
+
+    uint32_t status = neo_kernel_block_current(&join_waiters[index], timeout);
+    neo_kernel_unlock();
+    return status;
+}
+
+/**
+ * @brief Advance the sleep queue by one tick
+ * Called from thread_handler on every SysTick; only the head of the delta-ordered queue is decremented,
+ * so the cost is constant in the number of sleeping threads plus O(1) per thread that wakes up
+ */
+__attribute__((used)) void update_sleeping_threads(void)
+{
+    NEO_PROFILE_START(start_cycles);
+
+    if (sleep_queue_head != NEO_NO_THREAD)
+    {
+        sleep_delta[sleep_queue_head]--;
+        sleep_queue_wake_expired();
+    }
+
+    NEO_PROFILE_END(neo_sleep_tick_profile, start_cycles);
+}
+
+// blocks the running thread on an object; queue is the object's wait queue, or NULL when the object keeps its own waiters
+// must be called with the kernel locked
+static uint32_t block_current(neo_wait_queue_t *queue, const void *object, uint32_t timeout)
+{
+    uint32_t index = curr_running_thread_index;
+
+    if (queue)
+    {
+        uint8_t priority = thread_queue[index]->priority;
+        volatile uint8_t *link = &queue->head;
+        for (uint32_t steps = 0; steps < MAX_THREADS && in_wait_queue(*link, queue) && thread_queue[*link]->priority >= priority; steps++)
+        {
+            link = &wait_next[*link];
+        }
+        wait_next[index] = *link;
+        *link = (uint8_t)index;
+    }
+    waiting_on[index] = queue;
+    waiting_for[index] = object;
+    wait_result[index] = NEO_WAIT_OK;
+
+    if (timeout != NEO_WAIT_FOREVER)
+    {
+        neo_bitmap_set(&timed_threads_bit_mask, index);
+        sleep_queue_insert(index, NEO_MS_TO_TICKS(timeout));
+    }
+
+    neo_bitmap_set(&blocked_threads_bit_mask, index);
+    neo_bitmap_clear(&running_threads_bit_mask, index);
+    trigger_context_switch();
+    return NEO_WAIT_PENDING;
+}
+
+// makes a blocked thread that is no longer in a wait queue ready, cancelling its timeout
+// must be called with the kernel locked
+static void wake_blocked(uint32_t index)
+{
+    if (neo_bitmap_test(&timed_threads_bit_mask, index))
+    {
+        sleep_queue_remove(index);
+        neo_bitmap_clear(&timed_threads_bit_mask, index);
+    }
+    neo_bitmap_clear(&blocked_threads_bit_mask, index);
+    make_thread_ready(index);
+    preempt_if_needed();
+}
+
+/**
+ * @brief Block the running thread on a wait queue
+ * The thread is queued behind the waiters of the same or higher priority and a context switch is pended;
+ * it's taken once interrupts are enabled again (or once SVCall_handler returns)
+ * With a timeout, the thread also joins the sleep queue and is woken with NEO_WAIT_TIMEOUT if nothing wakes it first
+ * @param queue Wait queue of the object the thread blocks on
+ * @param timeout Milliseconds to wait, at least 1, or NEO_WAIT_FOREVER
+ * @return NEO_WAIT_PENDING; the outcome is in the thread's wait result once it runs again (see neo_kernel_wait_outcome)
+ * @note Must be called with the kernel locked, from a thread
+ */
+uint32_t neo_kernel_block_current(neo_wait_queue_t *queue, uint32_t timeout)
+{
+    return block_current(queue, queue, timeout);
+}
+
+/**
+ * @brief Block the running thread on an object that keeps track of its waiters itself
+ * Same as neo_kernel_block_current, but the thread isn't queued anywhere; the object wakes it with neo_kernel_wake
+ * and can tell whether it's still waiting with neo_kernel_is_waiting_for
+ * @param object The object the thread blocks on
+ * @param timeout Milliseconds to wait, at least 1, or NEO_WAIT_FOREVER
+ * @return NEO_WAIT_PENDING
+ * @note Must be called with the kernel locked, from a thread
+ */
+uint32_t neo_kernel_block_current_on(const void *object, uint32_t timeout)
+{
+    return block_current(NULL, object, timeout);
+}
+
+/**
+ * @brief Wake the highest-priority thread blocked on a wait queue
+ * The queue is kept sorted and the sleep queue is doubly linked, so this is O(1) even for a thread waiting with a timeout;
+ * the woken thread preempts the running one if its priority is higher
+ * @param queue Wait queue of the object
+ * @return Id of the woken thread, or NEO_NO_THREAD if nothing was waiting
+ * @note Must be called with the kernel locked
+ */
+uint32_t neo_kernel_wake_one(neo_wait_queue_t *queue)
+{
+    uint32_t index = queue->head;
+    if (!in_wait_queue(index, queue))
+    {
+        queue->head = NEO_NO_THREAD; // empty already, unless the head was overwritten
+        return NEO_NO_THREAD;
+    }
+
+    queue->head = wait_next[index];
+    wake_blocked(index);
+    return index;
+}
+
+/**
+ * @brief Wake a particular blocked thread with NEO_WAIT_OK
+ * @param index Id of a thread for which neo_kernel_is_waiting_for is true
+ * @note Must be called with the kernel locked
+ */
+void neo_kernel_wake(uint32_t index)
+{
+    if (waiting_on[index])
+    {
+        wait_queue_remove(index);
+    }
+    wake_blocked(index);
+}
+
+/**
+ * @brief Tell whether a thread is blocked on the given object
+ * @note Must be called with the kernel locked
+ */
+bool neo_kernel_is_waiting_for(uint32_t index, const void *object)
+{
+    return neo_bitmap_test(&blocked_threads_bit_mask, index) && waiting_for[index] == object;
+}
+
+/**
+ * @brief Change a thread's current priority; used for priority inheritance
+ * A ready thread moves to the ready set of its new priority; the running thread is switched out if it no longer has the
+ * highest priority. A thread sitting in a wait queue keeps its place there
+ * @param index Thread id
+ * @param priority New current priority; the thread's base priority is left as it is
+ * @note Must be called with the kernel locked
+ */
+void neo_kernel_set_priority(uint32_t index, uint8_t priority)
+{
+    uint8_t old_priority = thread_queue[index]->priority;
+    if (old_priority == priority)
+    {
+        return;
+    }
+
+    bool is_ready = neo_bitmap_test(&ready_threads_bit_mask[old_priority], index);
+    if (is_ready)
+    {
+        make_thread_unready(index);
+    }
+    thread_queue[index]->priority = priority;
+    if (is_ready)
+    {
+        make_thread_ready(index);
+    }
+    preempt_if_needed();
+}
+
+// puts the running thread to sleep for the given number of ticks and pends a context switch
+// must be called with the kernel locked
+static void sleep_current(uint32_t ticks)
+{
+    // set the thread state to SLEEPING and queue it; the tick only counts down the head of the sleep queue
+    neo_bitmap_set(&sleeping_threads_bit_mask, curr_running_thread_index);
+    neo_bitmap_clear(&running_threads_bit_mask, curr_running_thread_index);
+    sleep_queue_insert(curr_running_thread_index, ticks);
+    trigger_context_switch();
+}
+
+/**
+ * @brief Sleep for a time measured from this call
+ * The sleep ends on a tick boundary, so it lasts up to one tick less than asked; and time the thread spends preempted
+ * between computing the delay and making the call is added on top. Periodic threads use neo_thread_sleep_until instead
+ * @param time Milliseconds to sleep, rounded up to whole ticks; 0 just yields to the other ready threads
+ */
+void neo_sys_thread_sleep(uint32_t time)
+{
+    neo_kernel_lock();
+    if (time)
+    {
+        sleep_current(NEO_MS_TO_TICKS(time));
+    }
+    else
+    {
+        trigger_context_switch();
+    }
+    neo_kernel_unlock();
+}
+
+/**
+ * @brief Sleep until a period after the previous wakeup
+ * The deadline is *last_wake plus period, and *last_wake is advanced to it, so a periodic loop stays locked to the
+ * tick count however long each iteration runs or gets preempted. Works across tick_count wraparound as long as the
+ * period is shorter than the full tick range
+ * @param last_wake Tick count the period starts from; set it to get_tick_count() before the first call
+ * @param period Milliseconds between wakeups, rounded up to whole ticks
+ * @return true if the thread slept, false if the deadline had already passed (the thread overran its period);
+ * *last_wake is advanced either way. Also false, with *last_wake left alone, if the caller can't write *last_wake itself
+ */
+bool neo_sys_thread_sleep_until(uint32_t *last_wake, uint32_t period)
+{
+    if (!neo_mpu_caller_can_write(last_wake, sizeof(*last_wake)))
+    {
+        return false;
+    }
+
+    neo_kernel_lock();
+    uint32_t ticks = NEO_MS_TO_TICKS(period);
+    uint32_t elapsed = tick_count - *last_wake; // modulo 2^32, so a wrapped tick_count needs no special case
+    *last_wake += ticks;
+
+    bool sleeps = elapsed < ticks;
+    if (sleeps)
+    {
+        sleep_current(ticks - elapsed); // wakes up on the tick that makes tick_count equal to the new *last_wake
+    }
+    neo_kernel_unlock();
+    return sleeps;
+}
+
+// takes the memory from the pools and initializes the thread; NULL if the pools or the thread ids are used up
+static neo_thread_t *thread_create(void (*thread_function)(void *), void *thread_arg, uint32_t stack_size, uint8_t priority)
+{
+    neo_kernel_lock();
+    neo_thread_t *thread = thread_pool_alloc(stack_size);
+    neo_kernel_unlock();
+    if (!thread)
+    {
+        return NULL;
+    }
+
+    uint32_t slot = thread - thread_pool;
+    if (!neo_thread_init(thread, thread_function, thread_arg, thread_pool_stack[slot], stack_class_size[thread_pool_class[slot]], priority))
+    {
+        neo_kernel_lock();
+        thread_pool_free(thread);
+        neo_kernel_unlock();
+        return NULL;
+    }
+    return thread;
+}
+
+/**
+ * @brief Create and start a thread whose structure and stack come from the kernel's pools
+ * The stack is the smallest pool class with at least stack_size usable bytes (256, 512 or 1024 bytes, 32 of which are
+ * the MPU guard); both go back to the pools when the thread exits, so creating and tearing down threads is O(1) and
+ * doesn't fragment the neo_alloc heap
+ * @param thread_function Thread entry point function; the thread exits when it returns
+ * @param thread_arg Argument passed to thread function
+ * @param stack_size Usable stack size in bytes
+ * @param priority Scheduling priority, from NEO_MIN_PRIORITY (lowest) to NEO_MAX_PRIORITY (highest)
+ * @return The thread, or NULL if no stack of that size, structure or thread id is free
+ * @note The structure is reused once the thread has exited; join the thread before creating new ones if you need to
+ */
+neo_thread_t *neo_sys_thread_create(void (*thread_function)(void *), void *thread_arg, uint32_t stack_size, uint8_t priority)
+{
+    neo_thread_t *thread = thread_create(thread_function, thread_arg, stack_size, priority);
+    if (thread)
+    {
+        neo_sys_thread_start(thread);
+    }
+    return thread;
+}
+
+/* Thread API
+ * Unprivileged threads can't mask interrupts, so they reach the functions above through SVC (see neo_syscall.h);
+ * handlers and privileged threads call them directly and skip the exception entry and exit
+ */
+
+// the initial frame of every thread returns here from the thread function
+void neo_thread_exit(void)
+{
+    if (neo_in_privileged_context())
+    {
+        neo_sys_thread_exit();
+    }
+    else
+    {
+        neo_syscall(NEO_SYS_THREAD_EXIT, 0, 0, 0, 0);
+    }
+
+    while (true)
+    {
+        // never scheduled again
+    }
+}
+
+neo_thread_t *neo_thread_create(void (*thread_function)(void *), void *thread_arg, uint32_t stack_size, uint8_t priority)
+{
+    if (neo_in_privileged_context())
+    {
+        return neo_sys_thread_create(thread_function, thread_arg, stack_size, priority);
+    }
+    return (neo_thread_t *)neo_syscall(NEO_SYS_THREAD_CREATE, (uint32_t)thread_function, (uint32_t)thread_arg, stack_size, priority);
+}
+
+bool neo_thread_join(neo_thread_t *thread, uint32_t timeout)
+{
+    if (!neo_kernel_in_thread())
+    {
+        timeout = 0; // only a thread can block
+    }
+
+    uint32_t status;
+    if (neo_in_privileged_context())
+    {
+        status = neo_sys_thread_join(thread, timeout);
+    }
+    else
+    {
+        status = neo_syscall(NEO_SYS_THREAD_JOIN, (uint32_t)thread, timeout, 0, 0);
+    }
+    return neo_kernel_wait_outcome(status) == NEO_WAIT_OK;
+}
+
+bool neo_thread_start(neo_thread_t *thread)
+{
+    if (neo_in_privileged_context())
+    {
+        return neo_sys_thread_start(thread);
+    }
+    return neo_syscall(NEO_SYS_THREAD_START, (uint32_t)thread, 0, 0, 0);
+}
+
+void neo_thread_start_all_new(void)
+{
+    if (neo_in_privileged_context())
+    {
+        neo_sys_thread_start_all_new();
+        return;
+    }
+    neo_syscall(NEO_SYS_THREAD_START_ALL_NEW, 0, 0, 0, 0);
+}
+
+bool neo_thread_resume(neo_thread_t *thread)
+{
+    if (neo_in_privileged_context())
+    {
+        return neo_sys_thread_resume(thread);
+    }
+    return neo_syscall(NEO_SYS_THREAD_RESUME, (uint32_t)thread, 0, 0, 0);
+}
+
+void neo_thread_pause(void)
+{
+    if (neo_in_privileged_context())
+    {
+        neo_sys_thread_pause();
+        return;
+    }
+    neo_syscall(NEO_SYS_THREAD_PAUSE, 0, 0, 0, 0);
+}
+
+void neo_thread_sleep(uint32_t time)
+{
+    if (neo_in_privileged_context())
+    {
+        neo_sys_thread_sleep(time);
+        return;
+    }
+    neo_syscall(NEO_SYS_THREAD_SLEEP, time, 0, 0, 0);
+}
+
+bool neo_thread_sleep_until(uint32_t *last_wake, uint32_t period)
+{
+    if (neo_in_privileged_context())
+    {
+        return neo_sys_thread_sleep_until(last_wake, period);
+    }
+    return neo_syscall(NEO_SYS_THREAD_SLEEP_UNTIL, (uint32_t)last_wake, period, 0, 0);
+}
+
+/**
+ * @brief Kernel side of neo_sched_lock; one more level of the running thread's scheduler lock
+ */
+void neo_sys_sched_lock(void)
+{
+    // only the running thread writes its depth and handlers only read it, so this takes no kernel lock
+    uint32_t self_index = curr_running_thread_index;
+    if (sched_lock_depth[self_index] < UINT8_MAX) // a wrap to zero would drop the lock
+    {
+        sched_lock_depth[self_index]++;
+    }
+}
+
+/**
+ * @brief Kernel side of neo_sched_unlock; one level less, and the switch that was held off once the last one is gone
+ */
+void neo_sys_sched_unlock(void)
+{
+    uint32_t self_index = curr_running_thread_index;
+    if (!sched_lock_depth[self_index])
+    {
+        return;
+    }
+
+    neo_kernel_lock();
+    // a preemption after the depth reaches zero happens right away; one owed before is seen in sched_switch_deferred
+    if (!--sched_lock_depth[self_index] && sched_switch_deferred)
+    {
+        trigger_context_switch(); // the scheduler picks the thread that was owed the CPU, and clears the flag
+    }
+    neo_kernel_unlock(); // the pended PendSV is taken right here, or as soon as SVCall_handler returns
+}
+
+/**
+ * @brief Keep the calling thread from being preempted by other threads, while leaving interrupts enabled
+ * Handlers still run and may wake threads, but the switch to a woken thread, and the switch at the end of the time slice,
+ * is held off until the matching neo_sched_unlock. Use it for sections that only have to keep other threads out;
+ * data shared with handlers still needs the kernel lock
+ * Calls nest and the lock belongs to the calling thread; an unprivileged thread takes and drops it through a syscall,
+ * since its depth is in kernel RAM
+ * Blocking, sleeping or yielding while holding it still switches away from the thread, and the lock applies again once
+ * the thread runs; it does nothing outside a running thread (in main before the scheduler starts or in a handler)
+ */
+void neo_sched_lock(void)
+{
+    if (!neo_kernel_in_thread())
+    {
+        return;
+    }
+
+    if (neo_in_privileged_context())
+    {
+        neo_sys_sched_lock();
+    }
+    else
+    {
+        neo_syscall(NEO_SYS_SCHED_LOCK, 0, 0, 0, 0);
+    }
+    __asm__ volatile("" ::: "memory"); // the section's accesses stay after the lock is taken
+}
+
+/**
+ * @brief Drop one level of neo_sched_lock; the outermost one makes any switch that was held off, before returning
+ */
+void neo_sched_unlock(void)
+{
+    if (!neo_kernel_in_thread() || !sched_lock_depth[curr_running_thread_index])
+    {
+        return;
+    }
+    __asm__ volatile("" ::: "memory"); // the section's accesses stay before the lock is dropped
+
+    if (neo_in_privileged_context())
+    {
+        neo_sys_sched_unlock();
+        return;
+    }
+    neo_syscall(NEO_SYS_SCHED_UNLOCK, 0, 0, 0, 0);
+}
+
+#ifdef NEO_PROFILE
+
+#define SCHEDULER_BENCH_RUNS (3U)
+#define ROUND_ROBIN_THREADS (10U) // thread limit the round-robin loop was written for
+
+_Static_assert(MAX_THREADS >= ROUND_ROBIN_THREADS, "the scheduler benchmark uses up to 10 thread ids");
+
+// results of neo_profile_scheduler; index 0, 1 and 2 hold the runs with 1, 5 and 10 ready threads
+neo_profile_stat_t neo_bench_priority_pick[SCHEDULER_BENCH_RUNS];
+neo_profile_stat_t neo_bench_round_robin_pick[SCHEDULER_BENCH_RUNS];
+
+// the selection loop the scheduler used before priorities were introduced; kept only as the benchmark baseline
+static uint32_t round_robin_pick(uint32_t ready_mask, uint32_t last_index)
+{
+    uint32_t next_index = (last_index + 1) % ROUND_ROBIN_THREADS;
+    uint32_t start_index = next_index;
+
+    while (!(ready_mask & (1U << next_index)))
+    {
+        next_index++;
+        if (next_index == ROUND_ROBIN_THREADS)
+        {
+            next_index = 0;
+        }
+
+        if (next_index == start_index)
+        {
+            next_index = ROUND_ROBIN_THREADS;
+            break;
+        }
+    }
+
+    return next_index;
+}
+
+/**
+ * @brief Compare the cycle cost of picking the next thread against the old round-robin loop
+ * Runs both selections with 1, 5 and 10 ready threads, once for every possible previously running thread,
+ * and stores min/max/average cycles in neo_bench_priority_pick and neo_bench_round_robin_pick
+ * The kernel state is saved and restored; call it from main after neo_kernel_init and before starting threads
+ */
+void neo_profile_scheduler(void)
+{
+    static const uint8_t ready_counts[SCHEDULER_BENCH_RUNS] = {1, 5, 10};
+
+    neo_kernel_lock();
+    uint32_t saved_priorities = ready_priorities_bit_mask;
+    neo_thread_bitmap_t saved_ready = ready_threads_bit_mask[NEO_MIN_PRIORITY];
+    uint8_t saved_last = last_scheduled_at_priority[NEO_MIN_PRIORITY];
+
+    for (uint32_t run = 0; run < SCHEDULER_BENCH_RUNS; run++)
+    {
+        // the ready threads occupy the top slots so the round-robin loop has to walk over the empty ones
+        uint32_t ready_mask = ((1U << ready_counts[run]) - 1U) << (ROUND_ROBIN_THREADS - ready_counts[run]);
+        ready_threads_bit_mask[NEO_MIN_PRIORITY].summary = 1U;
+        ready_threads_bit_mask[NEO_MIN_PRIORITY].leaf[0] = ready_mask;
+        ready_priorities_bit_mask = (1U << NEO_MIN_PRIORITY) | (1U << NEO_IDLE_PRIORITY);
+
+        for (uint32_t last_index = 0; last_index < ROUND_ROBIN_THREADS; last_index++)
+        {
+            volatile uint32_t picked;
+
+            last_scheduled_at_priority[NEO_MIN_PRIORITY] = (uint8_t)last_index;
+            NEO_PROFILE_START(priority_start);
+            picked = pick_next_thread();
+            NEO_PROFILE_END(neo_bench_priority_pick[run], priority_start);
+
+            NEO_PROFILE_START(round_robin_start);
+            picked = round_robin_pick(ready_mask, last_index);
+            NEO_PROFILE_END(neo_bench_round_robin_pick[run], round_robin_start);
+            (void)picked;
+        }
+    }
+
+    ready_priorities_bit_mask = saved_priorities;
+    ready_threads_bit_mask[NEO_MIN_PRIORITY] = saved_ready;
+    last_scheduled_at_priority[NEO_MIN_PRIORITY] = saved_last;
+    neo_kernel_unlock();
+}
+
+neo_critical_window_t neo_critical_windows[NEO_CRITICAL_SITES];
+uint32_t neo_critical_entered_at;
+const char *neo_critical_function;
+
+/**
+ * @brief Fold the length of a critical section into the worst case of the function it was in
+ * Called by neo_kernel_unlock with the kernel still locked; functions beyond NEO_CRITICAL_SITES aren't tracked
+ * @param function Name of the function, as given by __func__
+ * @param cycles Cycles BASEPRI was raised for
+ */
+void neo_critical_record(const char *function, uint32_t cycles)
+{
+    for (uint32_t site = 0; site < NEO_CRITICAL_SITES; site++)
+    {
+        neo_critical_window_t *window = &neo_critical_windows[site];
+        if (!window->function)
+        {
+            window->function = function; // sites are only ever added, so the first empty one ends the search
+        }
+        if (window->function == function)
+        {
+            if (cycles > window->max)
+            {
+                window->max = cycles;
+            }
+            window->count++;
+            return;
+        }
+    }
+}
+
+#define THREAD_BENCH_RUNS (16U)
+
+// results of neo_profile_thread_create; index c holds the runs that got a stack of class c
+neo_profile_stat_t neo_bench_thread_create[STACK_CLASSES];
+neo_profile_stat_t neo_bench_thread_release[STACK_CLASSES];
+
+static void bench_thread_function(void *arg)
+{
+    (void)arg;
+}
+
+/**
+ * @brief Measure the cycle cost of spawning a pool thread and of tearing it down after it exits
+ * Creation covers the pools, the thread id and the initial frame; teardown is what the scheduler does for an exited
+ * thread. Each stack class is run THREAD_BENCH_RUNS times and the results go to neo_bench_thread_create and
+ * neo_bench_thread_release
+ * Call it from main after neo_kernel_init and before starting threads
+ */
+void neo_profile_thread_create(void)
+{
+    for (uint32_t class = 0; class < STACK_CLASSES; class++)
+    {
+        for (uint32_t run = 0; run < THREAD_BENCH_RUNS; run++)
+        {
+            NEO_PROFILE_START(create_start);
+            neo_thread_t *thread = thread_create(bench_thread_function, NULL, stack_class_size[class] - NEO_MPU_GUARD_SIZE, NEO_MIN_PRIORITY);
+            NEO_PROFILE_END(neo_bench_thread_create[class], create_start);
+            if (!thread)
+            {
+                return;
+            }
+
+            // the thread never ran; pretend it exited and was switched out
+            NEO_PROFILE_START(release_start);
+            neo_kernel_lock();
+            neo_bitmap_clear(&new_threads_bit_mask, thread->thread_id);
+            release_thread(thread->thread_id);
+            neo_kernel_unlock();
+            NEO_PROFILE_END(neo_bench_thread_release[class], release_start);
+        }
+    }
+}
+
+#define SLEEP_BENCH_TICKS (16U)
+
+// results of neo_profile_sleep_queue; index n - 1 holds the tick cost with n sleeping threads
+neo_profile_stat_t neo_bench_sleep_tick[MAX_THREADS];
+
+/**
+ * @brief Measure the per-tick cost of the sleep queue from 1 to MAX_THREADS sleeping threads
+ * Queues n dummy sleepers far enough in the future that none of them wakes up, then times update_sleeping_threads
+ * over SLEEP_BENCH_TICKS ticks; results go to neo_bench_sleep_tick
+ * Call it from main after neo_kernel_init and before starting threads, while nothing is sleeping
+ */
+void neo_profile_sleep_queue(void)
+{
+    neo_kernel_lock();
+    for (uint32_t sleepers = 1; sleepers <= MAX_THREADS; sleepers++)
+    {
+        sleep_queue_head = NEO_NO_THREAD;
+        for (uint32_t index = 0; index < sleepers; index++)
+        {
+            sleep_queue_insert(index, 1000U + index);
+        }
+
+        for (uint32_t tick = 0; tick < SLEEP_BENCH_TICKS; tick++)
+        {
+            NEO_PROFILE_START(tick_start);
+            update_sleeping_threads();
+            NEO_PROFILE_END(neo_bench_sleep_tick[sleepers - 1U], tick_start);
+        }
+    }
+    sleep_queue_head = NEO_NO_THREAD;
+    neo_kernel_unlock();
+}
+
+#define PERIOD_BENCH_RUNS (10000U)
+#define PERIOD_BENCH_MS (2U)
+
+// results of neo_profile_periodic
+neo_profile_stat_t neo_bench_period;        // cycles between consecutive wakeups
+neo_profile_stat_t neo_bench_period_jitter; // cycles each wakeup was off from PERIOD_BENCH_MS, either way
+volatile int32_t neo_bench_period_drift;    // all periods together minus PERIOD_BENCH_RUNS ideal periods, in cycles
+volatile uint32_t neo_bench_period_overruns; // periods neo_thread_sleep_until found already over
+volatile bool neo_bench_period_done;
+
+/**
+ * @brief Thread function that runs PERIOD_BENCH_RUNS periods of PERIOD_BENCH_MS with neo_thread_sleep_until
+ * Times every period with the cycle counter and records the jitter around the ideal period and the drift accumulated
+ * over all of them, which stays within one period's jitter since the deadlines are absolute; sets
+ * neo_bench_period_done when finished, then exits
+ * Run it at a high priority in a privileged thread, since the cycle counter and SysTick are only accessible to privileged
+ * code; from main, neo_thread_init it on a stack of its own, call neo_thread_set_privileged and then neo_thread_start
+ * @note The cycle counter has to keep running while the core sleeps in the idle thread; if it doesn't on the part at
+ * hand, build with NEO_TICKLESS_IDLE=0 and keep another thread busy at a lower priority
+ */
+void neo_profile_periodic(void *arg)
+{
+    (void)arg;
+#if NEO_TICKLESS_IDLE
+    uint32_t ideal = NEO_MS_TO_TICKS(PERIOD_BENCH_MS) * systick_counts_per_tick; // SysTick counts processor cycles
+#else
+    uint32_t ideal = NEO_MS_TO_TICKS(PERIOD_BENCH_MS) * (SysTick->LOAD + 1U);
+#endif
+    int32_t drift = 0;
+
+    uint32_t last_wake = get_tick_count();
+    neo_thread_sleep_until(&last_wake, PERIOD_BENCH_MS); // start on a tick boundary
+    uint32_t previous = neo_profile_cycles();
+    for (uint32_t run = 0; run < PERIOD_BENCH_RUNS; run++)
+    {
+        if (!neo_thread_sleep_until(&last_wake, PERIOD_BENCH_MS))
+        {
+            neo_bench_period_overruns++;
+        }
+        uint32_t now = neo_profile_cycles();
+        uint32_t period = now - previous;
+        previous = now;
+
+        int32_t error = (int32_t)(period - ideal);
+        drift += error;
+        neo_profile_record(&neo_bench_period, period);
+        neo_profile_record(&neo_bench_period_jitter, error < 0 ? (uint32_t)-error : (uint32_t)error);
+    }
+    neo_bench_period_drift = drift;
+    neo_bench_period_done = true;
+}
+
+#endif // NEO_PROFILE
@@ -0,0 +1,308 @@
+#include "neo_timer.h"
+#include "neo_kernel.h"
+#include "neo_syscall.h"
+#include "neo_pool.h"
+#include <stddef.h>
+
+extern volatile uint32_t tick_count;
+
+NEO_KERNEL_POOL(timer_pool, sizeof(neo_timer_t), NEO_TIMERS);
+NEO_KERNEL_BSS static neo_timer_t *active_timers; // earliest expiry first; the timer thread blocks on this list
+
+static NEO_THREAD_STACK(timer_stack, NEO_TIMER_STACK_WORDS);
+NEO_KERNEL_BSS static neo_thread_t timer_thread;
+NEO_KERNEL_BSS static volatile bool timer_service_started;
+
+// callbacks collected by the last neo_sys_timer_service call; only the timer thread reads them, and only the kernel writes them
+NEO_KERNEL_BSS static struct
+{
+    void (*callback)(void *arg);
+    void *arg;
+} timer_batch[NEO_TIMERS];
+
+// longest wait the timer thread asks for, in ticks; in milliseconds it stays below NEO_WAIT_FOREVER
+#define MAX_WAIT_TICKS ((NEO_WAIT_FOREVER - 1U) / NEO_TICK_MS)
+
+// true if tick a comes before tick b; right across tick_count wraparound while they are less than 2^31 ticks apart
+static inline bool tick_before(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
+static inline bool is_timer(const neo_timer_t *timer)
+{
+    return neo_pool_owns(&timer_pool, timer) && timer->in_use; // in_use is past the pool's link word, so a free block keeps it false
+}
+
+// must be called with the kernel locked
+static void timer_insert(neo_timer_t *timer)
+{
+    neo_timer_t **link = &active_timers;
+    while (*link && !tick_before(timer->expiry, (*link)->expiry))
+    {
+        link = &(*link)->next; // behind the timers due on the same tick, so they run in the order they were armed
+    }
+    timer->next = *link;
+    *link = timer;
+    timer->active = true;
+
+    // the timer thread sleeps until the previous earliest expiry, or for good if there was none
+    if (active_timers == timer && neo_kernel_is_waiting_for(timer_thread.thread_id, &active_timers))
+    {
+        neo_kernel_wake(timer_thread.thread_id);
+    }
+}
+
+// must be called with the kernel locked
+static void timer_remove(neo_timer_t *timer)
+{
+    neo_timer_t **link = &active_timers;
+    while (*link != timer)
+    {
+        link = &(*link)->next;
+    }
+    *link = timer->next;
+    timer->active = false; // the timer thread may now wake up early and find nothing due; it just goes back to sleep
+}
+
+static void timer_thread_function(void *arg)
+{
+    (void)arg;
+    while (true)
+    {
+        uint32_t count;
+        if (neo_in_privileged_context())
+        {
+            count = neo_sys_timer_service();
+        }
+        else
+        {
+            count = neo_syscall(NEO_SYS_TIMER_SERVICE, 0, 0, 0, 0);
+        }
+
+        for (uint32_t expired = 0; expired < count; expired++)
+        {
+            timer_batch[expired].callback(timer_batch[expired].arg);
+        }
+    }
+}
+
+// sets up and starts the timer thread the first time a timer is created
+static bool timer_service_start(void)
+{
+    neo_kernel_lock();
+    bool start = !timer_service_started;
+    timer_service_started = true;
+    neo_kernel_unlock();
+    if (!start)
+    {
+        return true;
+    }
+
+    if (!neo_thread_init(&timer_thread, timer_thread_function, NULL, (uint8_t *)timer_stack, sizeof(timer_stack), NEO_TIMER_THREAD_PRIORITY))
+    {
+        neo_kernel_lock(); // a creator on another thread may be testing the flag
+        timer_service_started = false;
+        neo_kernel_unlock();
+        return false;
+    }
+    neo_sys_thread_start(&timer_thread);
+    return true;
+}
+
+/**
+ * @brief Kernel side of the timer thread's loop
+ * Takes every timer due by now off the active list, rearms the periodic ones and copies the callbacks into the batch;
+ * if none is due, blocks the timer thread until the earliest expiry, or until a timer expiring earlier is armed
+ * @return Number of callbacks in the batch; 0 if the timer thread was blocked, or if the caller isn't the timer thread
+ */
+uint32_t neo_sys_timer_service(void)
+{
+    neo_kernel_lock();
+    if (thread_queue[neo_kernel_current_thread()] != &timer_thread)
+    {
+        neo_kernel_unlock(); // any thread can make the syscall, but only the timer thread may take the expired timers
+        return 0;
+    }
+    uint32_t now = tick_count;
+    uint32_t count = 0;
+    while (active_timers && !tick_before(now, active_timers->expiry))
+    {
+        neo_timer_t *timer = active_timers;
+        active_timers = timer->next;
+        timer->active = false;
+
+        timer_batch[count].callback = timer->callback;
+        timer_batch[count].arg = timer->arg;
+        count++;
+
+        if (!timer->one_shot)
+        {
+            do
+            {
+                timer->expiry += timer->period; // from the previous expiry, so the timer doesn't drift
+            } while (!tick_before(now, timer->expiry));
+            timer_insert(timer); // due after now, so it isn't taken again in this pass
+        }
+    }
+
+    if (!count)
+    {
+        uint32_t timeout = NEO_WAIT_FOREVER;
+        if (active_timers)
+        {
+            // clamped before the conversion, which could otherwise wrap to a short wait or to NEO_WAIT_FOREVER; waking
+            // before the timer is due only costs another pass
+            uint32_t ticks = active_timers->expiry - now;
+            timeout = (ticks < MAX_WAIT_TICKS ? ticks : MAX_WAIT_TICKS) * NEO_TICK_MS;
+        }
+        neo_kernel_block_current_on(&active_timers, timeout);
+    }
+    neo_kernel_unlock();
+    return count;
+}
+
+/**
+ * @brief Kernel side of neo_timer_create
+ */
+neo_timer_t *neo_sys_timer_create(uint32_t period, bool one_shot, void (*callback)(void *arg), void *arg)
+{
+    if (!period || !callback || !timer_service_start())
+    {
+        return NULL;
+    }
+
+    neo_kernel_lock();
+    neo_timer_t *timer = neo_kernel_pool_take(&timer_pool);
+    if (timer)
+    {
+        timer->in_use = true;
+        timer->callback = callback;
+        timer->arg = arg;
+        timer->one_shot = one_shot;
+        timer->period = NEO_MS_TO_TICKS(period);
+        timer->expiry = tick_count + timer->period;
+        timer_insert(timer);
+    }
+    neo_kernel_unlock();
+    return timer;
+}
+
+/**
+ * @brief Kernel side of neo_timer_start
+ */
+bool neo_sys_timer_start(neo_timer_t *timer)
+{
+    neo_kernel_lock();
+    if (!is_timer(timer))
+    {
+        neo_kernel_unlock();
+        return false;
+    }
+
+    if (timer->active)
+    {
+        timer_remove(timer);
+    }
+    timer->expiry = tick_count + timer->period;
+    timer_insert(timer);
+    neo_kernel_unlock();
+    return true;
+}
+
+/**
+ * @brief Kernel side of neo_timer_stop
+ */
+bool neo_sys_timer_stop(neo_timer_t *timer)
+{
+    neo_kernel_lock();
+    bool was_active = is_timer(timer) && timer->active;
+    if (was_active)
+    {
+        timer_remove(timer);
+    }
+    neo_kernel_unlock();
+    return was_active;
+}
+
+/**
+ * @brief Kernel side of neo_timer_delete
+ */
+bool neo_sys_timer_delete(neo_timer_t *timer)
+{
+    neo_kernel_lock();
+    if (!is_timer(timer))
+    {
+        neo_kernel_unlock();
+        return false;
+    }
+
+    if (timer->active)
+    {
+        timer_remove(timer);
+    }
+    timer->in_use = false;
+    neo_kernel_pool_give(&timer_pool, timer);
+    neo_kernel_unlock();
+    return true;
+}
+
+/**
+ * @brief Create a timer and start it
+ * @param period Milliseconds from now to the first expiry, and between expiries of a periodic timer; below 2^31 ticks
+ * @param one_shot true to run the callback once and stop, false to run it every period
+ * @param callback Function run in the timer thread on every expiry
+ * @param arg Argument passed to the callback
+ * @return The timer, or NULL if all NEO_TIMERS timers exist, an argument is invalid or the timer thread can't be started
+ */
+neo_timer_t *neo_timer_create(uint32_t period, bool one_shot, void (*callback)(void *arg), void *arg)
+{
+    if (neo_in_privileged_context())
+    {
+        return neo_sys_timer_create(period, one_shot, callback, arg);
+    }
+    return (neo_timer_t *)neo_syscall(NEO_SYS_TIMER_CREATE, period, one_shot, (uint32_t)callback, (uint32_t)arg);
+}
+
+/**
+ * @brief Restart a timer so that it next expires a full period from now; rearms a one-shot timer that has expired
+ * @param timer Pointer to a timer from neo_timer_create
+ * @return true if the timer was restarted, false if it doesn't exist
+ */
+bool neo_timer_start(neo_timer_t *timer)
+{
+    if (neo_in_privileged_context())
+    {
+        return neo_sys_timer_start(timer);
+    }
+    return neo_syscall(NEO_SYS_TIMER_START, (uint32_t)timer, 0, 0, 0);
+}
+
+/**
+ * @brief Stop a timer; it keeps existing and can be restarted with neo_timer_start
+ * A callback already collected into the timer thread's current batch still runs once
+ * @param timer Pointer to a timer from neo_timer_create
+ * @return true if the timer was running
+ */
+bool neo_timer_stop(neo_timer_t *timer)
+{
+    if (neo_in_privileged_context())
+    {
+        return neo_sys_timer_stop(timer);
+    }
+    return neo_syscall(NEO_SYS_TIMER_STOP, (uint32_t)timer, 0, 0, 0);
+}
+
+/**
+ * @brief Stop a timer and give it back for neo_timer_create to reuse
+ * @param timer Pointer to a timer from neo_timer_create; not to be used again
+ * @return true if the timer was deleted, false if it doesn't exist
+ */
+bool neo_timer_delete(neo_timer_t *timer)
+{
+    if (neo_in_privileged_context())
+    {
+        return neo_sys_timer_delete(timer);
+    }
+    return neo_syscall(NEO_SYS_TIMER_DELETE, (uint32_t)timer, 0, 0, 0);
+}
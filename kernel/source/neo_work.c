@@ -0,0 +1,143 @@
+#include "neo_work.h"
+#include "neo_kernel.h"
+#include "neo_syscall.h"
+#include "neo_profile.h"
+#include <stddef.h>
+
+_Static_assert(NEO_WORK_ITEMS >= 2U && !(NEO_WORK_ITEMS & (NEO_WORK_ITEMS - 1U)), "NEO_WORK_ITEMS must be a power of two");
+
+/* Position pos in the ring uses slot pos % NEO_WORK_ITEMS in lap pos / NEO_WORK_ITEMS; a slot's turn says who may use
+ * it next: 2 * lap for the producer of that lap, 2 * lap + 1 for the consumer. Turns are 8 bits wide so that they wrap
+ * together with the 32-bit positions, and zero means a free slot in lap 0, so the ring needs no initialization
+ */
+typedef struct
+{
+    volatile uint8_t turn;
+    void (*function)(void *arg);
+    void *arg;
+#ifdef NEO_PROFILE
+    uint32_t posted_at; // cycle count when posted
+#endif
+} work_slot_t;
+
+NEO_KERNEL_BSS static work_slot_t work_ring[NEO_WORK_ITEMS];
+NEO_KERNEL_BSS static volatile uint32_t work_tail; // next position to post to; claimed by producers with LDREX/STREX
+NEO_KERNEL_BSS static uint32_t work_head;          // next position to run; only the worker touches it
+
+NEO_KERNEL_BSS static NEO_THREAD_STACK(work_stack, NEO_WORK_STACK_WORDS);
+NEO_KERNEL_BSS static neo_thread_t work_thread;
+NEO_KERNEL_BSS static volatile bool worker_sleeping; // the worker is blocked on the empty ring, or about to be
+NEO_KERNEL_BSS static bool worker_started;
+
+#ifdef NEO_PROFILE
+neo_profile_stat_t neo_bench_work_post;
+neo_profile_stat_t neo_bench_work_post_full;
+neo_profile_stat_t neo_bench_work_latency;
+#endif
+
+static inline uint8_t producer_turn(uint32_t pos)
+{
+    return (uint8_t)(pos / NEO_WORK_ITEMS * 2U);
+}
+
+static void work_thread_function(void *arg)
+{
+    (void)arg;
+    while (true)
+    {
+        work_slot_t *slot = &work_ring[work_head % NEO_WORK_ITEMS];
+        if (slot->turn != (uint8_t)(producer_turn(work_head) + 1U))
+        {
+            // a post can't slip in between this check and blocking, so it either sees worker_sleeping or is seen here
+            neo_kernel_lock();
+            if (slot->turn != (uint8_t)(producer_turn(work_head) + 1U))
+            {
+                worker_sleeping = true;
+                neo_kernel_block_current_on(work_ring, NEO_WAIT_FOREVER);
+            }
+            neo_kernel_unlock();
+            continue;
+        }
+
+        __DMB(); // the item is read only after its turn says it's complete
+        void (*function)(void *arg) = slot->function;
+        void *function_arg = slot->arg;
+#ifdef NEO_PROFILE
+        neo_profile_record(&neo_bench_work_latency, neo_profile_cycles() - slot->posted_at);
+#endif
+        __DMB(); // done with the slot before handing it back
+        slot->turn = producer_turn(work_head + NEO_WORK_ITEMS);
+        work_head++;
+
+        function(function_arg);
+    }
+}
+
+/**
+ * @brief Create and start the worker thread
+ * Items posted before this wait in the queue until the worker runs; call it from main before starting the threads
+ * @param priority Priority the posted items run at, from NEO_MIN_PRIORITY to NEO_MAX_PRIORITY
+ * @return true if the worker was started, false if it already runs, the caller isn't privileged or no thread id is free
+ */
+bool neo_work_init(uint8_t priority)
+{
+    if (worker_started || !neo_thread_init(&work_thread, work_thread_function, NULL, (uint8_t *)work_stack, sizeof(work_stack), priority))
+    {
+        return false;
+    }
+    neo_thread_set_privileged(&work_thread, true); // the items come from handlers and drivers
+    worker_started = neo_thread_start(&work_thread);
+    return worker_started;
+}
+
+/**
+ * @brief Queue a function to run in the worker thread
+ * Callable from handlers at or below the kernel ceiling and from privileged threads; doesn't block and only locks the
+ * kernel if the worker has to be woken up
+ * @param function Function to run; it may block, but holds up the items behind it while it does
+ * @param arg Argument passed to the function
+ * @return true if the item was queued, false if the queue is full or the caller isn't privileged
+ */
+bool neo_work_post(void (*function)(void *arg), void *arg)
+{
+    if (!function || !neo_in_privileged_context())
+    {
+        return false;
+    }
+
+    NEO_PROFILE_START(post_start); // after the checks, so every measurement is of an attempt to queue
+
+    uint32_t pos;
+    do
+    {
+        pos = __LDREXW(&work_tail);
+        if (work_ring[pos % NEO_WORK_ITEMS].turn != producer_turn(pos))
+        {
+            __CLREX();
+            NEO_PROFILE_END(neo_bench_work_post_full, post_start);
+            return false; // full; the worker hasn't run the item from the previous lap yet
+        }
+    } while (__STREXW(pos + 1U, &work_tail)); // fails only if an exception came in between; just try again
+
+    work_slot_t *slot = &work_ring[pos % NEO_WORK_ITEMS];
+    slot->function = function;
+    slot->arg = arg;
+#ifdef NEO_PROFILE
+    slot->posted_at = post_start;
+#endif
+    __DMB(); // the item is complete before the worker can see it
+    slot->turn = (uint8_t)(producer_turn(pos) + 1U);
+
+    if (worker_sleeping)
+    {
+        neo_kernel_lock();
+        worker_sleeping = false;
+        if (neo_kernel_is_waiting_for(work_thread.thread_id, work_ring))
+        {
+            neo_kernel_wake(work_thread.thread_id);
+        }
+        neo_kernel_unlock();
+    }
+    NEO_PROFILE_END(neo_bench_work_post, post_start);
+    return true;
+}
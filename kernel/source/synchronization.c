@@ -0,0 +1,597 @@
+#include "synchronization.h"
+#include "neo_syscall.h"
+
+/* what each thread blocked on an event group waits for */
+NEO_KERNEL_BSS static uint32_t event_wait_bits[MAX_THREADS];
+NEO_KERNEL_BSS static uint8_t event_wait_options[MAX_THREADS];
+
+/* Priority inheritance
+ * A thread's priority is the highest of its base priority and the top waiters of the contended mutexes it owns. Each
+ * owner has a list of those mutexes, kept in kernel RAM rather than in the mutexes, which unprivileged threads can
+ * write: an entry is a thread blocked on the mutex (waiting_mutex says which), linked through inherit_next. The queue of
+ * a mutex is sorted, so the priority is one look at the head of each of the owner's mutexes
+ * Walks are bounded by MAX_THREADS and entries whose thread no longer waits on a mutex of that owner are dropped, so a
+ * mutex overwritten by a user thread can only cost priorities, never a kernel write out of place
+ */
+NEO_KERNEL_BSS static neo_mutex_t *waiting_mutex[MAX_THREADS];                                        // the mutex each thread last blocked on
+NEO_KERNEL_DATA static uint8_t inherit_head[MAX_THREADS] = {[0 ... MAX_THREADS - 1] = NEO_NO_THREAD}; // first entry of each owner's list
+NEO_KERNEL_BSS static uint8_t inherit_next[MAX_THREADS];                                              // next entry of the same list
+
+// thread id of the owner in a mutex's owner word; NEO_MUTEX_CONTENDED is ignored, and a free mutex gives 0xFFFFFFFF
+static inline uint32_t owner_index(uint32_t owner)
+{
+    return (owner & ~NEO_MUTEX_CONTENDED) - 1U;
+}
+
+// highest-priority thread blocked on the mutex, or NEO_NO_THREAD; the head is checked since the mutex is writable
+// must be called with the kernel locked
+static uint32_t top_waiter(neo_mutex_t *mutex)
+{
+    uint32_t head = mutex->waiters.head;
+    return head < MAX_THREADS && neo_kernel_is_waiting_for(head, &mutex->waiters) ? head : NEO_NO_THREAD;
+}
+
+// adds a contended mutex to its owner's list, through a thread blocked on it
+// must be called with the kernel locked
+static void inherit_link(uint32_t owner, uint32_t waiter)
+{
+    inherit_next[waiter] = inherit_head[owner];
+    inherit_head[owner] = (uint8_t)waiter;
+}
+
+// takes a mutex off its owner's list
+// must be called with the kernel locked
+static void inherit_unlink(uint32_t owner, const neo_mutex_t *mutex)
+{
+    uint8_t *link = &inherit_head[owner];
+    for (uint32_t steps = 0; *link != NEO_NO_THREAD && steps < MAX_THREADS; steps++)
+    {
+        if (waiting_mutex[*link] == mutex)
+        {
+            *link = inherit_next[*link];
+            return;
+        }
+        link = &inherit_next[*link];
+    }
+}
+
+// returns the priority the thread is entitled to from its base priority and the mutexes it holds; O(number of them)
+// must be called with the kernel locked
+static uint8_t inherited_priority(uint32_t index)
+{
+    uint8_t priority = thread_queue[index]->base_priority;
+    uint8_t *link = &inherit_head[index];
+    for (uint32_t steps = 0; *link != NEO_NO_THREAD && steps < MAX_THREADS; steps++)
+    {
+        uint32_t waiter = *link;
+        neo_mutex_t *mutex = waiting_mutex[waiter];
+        // only a mutex the entry is still blocked on is read, and that one was checked when the entry blocked
+        if (!neo_kernel_is_waiting_for(waiter, &mutex->waiters) || owner_index(mutex->owner) != index)
+        {
+            *link = inherit_next[waiter]; // stale
+            continue;
+        }
+
+        uint32_t top = top_waiter(mutex);
+        uint8_t waiter_priority = neo_kernel_priority(top == NEO_NO_THREAD ? waiter : top);
+        if (waiter_priority > priority)
+        {
+            priority = waiter_priority;
+        }
+        link = &inherit_next[waiter];
+    }
+    return priority;
+}
+
+/**
+ * @brief Initialize a mutex as free; same as assigning NEO_MUTEX_INIT
+ * @param mutex Pointer to mutex structure
+ */
+void neo_mutex_init(neo_mutex_t *mutex)
+{
+    mutex->owner = 0;
+    neo_wait_queue_init(&mutex->waiters);
+}
+
+/**
+ * @brief Kernel side of neo_mutex_lock, entered when the fast path found the mutex taken
+ * Blocks the caller until the owner hands the mutex over, raising the owner to the caller's priority meanwhile
+ * @return true once the caller owns the mutex; false if the caller already owns it or can't write the mutex itself
+ */
+bool neo_sys_mutex_lock(neo_mutex_t *mutex)
+{
+    if (!neo_mpu_caller_can_write(mutex, sizeof(*mutex)))
+    {
+        return false;
+    }
+    uint32_t self_index = neo_kernel_current_thread();
+
+    neo_kernel_lock();
+    uint32_t owner = mutex->owner;
+    uint32_t owner_id = owner_index(owner);
+    if (owner_id >= MAX_THREADS || !thread_queue[owner_id])
+    {
+        // released between the fast path and here, or the owner word doesn't name a thread (the owner exited holding
+        // the mutex, or the word was overwritten); the caller takes the mutex over
+        mutex->owner = (self_index + 1U) | (neo_wait_queue_is_empty(&mutex->waiters) ? 0U : NEO_MUTEX_CONTENDED);
+        neo_kernel_unlock();
+        return true;
+    }
+
+    if (owner_id == self_index)
+    {
+        neo_kernel_unlock();
+        return false;
+    }
+
+    // from now on the owner's fast unlock fails and it comes through neo_sys_mutex_unlock
+    mutex->owner = owner | NEO_MUTEX_CONTENDED;
+
+    waiting_mutex[self_index] = mutex;
+    neo_kernel_block_current(&mutex->waiters, NEO_WAIT_FOREVER);
+    if (!(owner & NEO_MUTEX_CONTENDED))
+    {
+        inherit_link(owner_id, self_index); // the first waiter puts the mutex on its owner's list
+    }
+    if (neo_kernel_priority(self_index) > neo_kernel_priority(owner_id))
+    {
+        neo_kernel_set_priority(owner_id, neo_kernel_priority(self_index));
+    }
+    neo_kernel_unlock(); // the context switch happens here; once this thread runs again, the mutex has been handed to it
+    return true;
+}
+
+/**
+ * @brief Kernel side of neo_mutex_unlock, entered when threads are waiting on the mutex (or the caller doesn't own it)
+ * Hands the mutex to the highest-priority waiter and gives up the priority inherited through it
+ * @return true if the mutex was released; false if the caller doesn't own it or can't write it itself
+ */
+bool neo_sys_mutex_unlock(neo_mutex_t *mutex)
+{
+    if (!neo_mpu_caller_can_write(mutex, sizeof(*mutex)))
+    {
+        return false;
+    }
+    uint32_t self_index = neo_kernel_current_thread();
+
+    neo_kernel_lock();
+    uint32_t owner = mutex->owner;
+    if ((owner & ~NEO_MUTEX_CONTENDED) != self_index + 1U)
+    {
+        neo_kernel_unlock();
+        return false;
+    }
+
+    inherit_unlink(self_index, mutex); // the contended bit is user-writable, so don't trust it to say whether it's listed
+
+    uint32_t next_index = neo_kernel_wake_one(&mutex->waiters);
+    uint32_t top = next_index == NEO_NO_THREAD ? NEO_NO_THREAD : top_waiter(mutex);
+    if (next_index == NEO_NO_THREAD)
+    {
+        mutex->owner = 0;
+    }
+    else if (top == NEO_NO_THREAD)
+    {
+        mutex->owner = next_index + 1U;
+    }
+    else
+    {
+        // the new owner inherits from the threads still waiting
+        mutex->owner = (next_index + 1U) | NEO_MUTEX_CONTENDED;
+        inherit_link(next_index, top);
+        neo_kernel_set_priority(next_index, inherited_priority(next_index));
+    }
+
+    neo_kernel_set_priority(self_index, inherited_priority(self_index)); // switches to the woken thread if it now outranks this one
+    neo_kernel_unlock();
+    return true;
+}
+
+/**
+ * @brief Lock a mutex, blocking until it's available
+ * @param mutex Pointer to mutex structure
+ * @return true once the mutex is owned; false if called outside a thread or if the caller already owns the mutex
+ */
+bool neo_mutex_lock(neo_mutex_t *mutex)
+{
+    if (!neo_kernel_in_thread())
+    {
+        return false;
+    }
+
+    uint32_t self = neo_kernel_current_thread() + 1U;
+    do
+    {
+        if (__LDREXW(&mutex->owner))
+        {
+            __CLREX();
+            if (neo_in_privileged_context())
+            {
+                return neo_sys_mutex_lock(mutex);
+            }
+            return neo_syscall(NEO_SYS_MUTEX_LOCK, (uint32_t)mutex, 0, 0, 0);
+        }
+    } while (__STREXW(self, &mutex->owner)); // fails only if an exception came in between; just try again
+
+    __DMB(); // nothing from the critical section is accessed before the mutex is owned
+    return true;
+}
+
+/**
+ * @brief Unlock a mutex, handing it to the highest-priority waiter if there is one
+ * @param mutex Pointer to mutex structure
+ * @return true if the mutex was released; false if called outside a thread or if the caller doesn't own the mutex
+ */
+bool neo_mutex_unlock(neo_mutex_t *mutex)
+{
+    if (!neo_kernel_in_thread())
+    {
+        return false;
+    }
+
+    uint32_t self = neo_kernel_current_thread() + 1U;
+    __DMB(); // everything done in the critical section is visible before the mutex is seen free
+    do
+    {
+        if (__LDREXW(&mutex->owner) != self)
+        {
+            __CLREX();
+            if (neo_in_privileged_context())
+            {
+                return neo_sys_mutex_unlock(mutex);
+            }
+            return neo_syscall(NEO_SYS_MUTEX_UNLOCK, (uint32_t)mutex, 0, 0, 0);
+        }
+    } while (__STREXW(0, &mutex->owner));
+
+    return true;
+}
+
+/**
+ * @brief Initialize a semaphore; same as assigning NEO_SEM_INIT
+ * @param sem Pointer to semaphore structure
+ * @param initial_count Count the semaphore starts with
+ * @param limit Highest count; 1 makes a binary semaphore
+ */
+void neo_sem_init(neo_sem_t *sem, uint32_t initial_count, uint32_t limit)
+{
+    sem->count = initial_count;
+    sem->limit = limit;
+    neo_wait_queue_init(&sem->waiters);
+}
+
+/**
+ * @brief Kernel side of neo_sem_take
+ * @return NEO_WAIT_OK if the count was taken, NEO_WAIT_TIMEOUT if it's zero and timeout is zero,
+ * NEO_WAIT_PENDING if the caller was blocked; NEO_WAIT_TIMEOUT as well if the caller can't write the semaphore itself
+ */
+uint32_t neo_sys_sem_take(neo_sem_t *sem, uint32_t timeout)
+{
+    if (!neo_mpu_caller_can_write(sem, sizeof(*sem)))
+    {
+        return NEO_WAIT_TIMEOUT;
+    }
+
+    neo_kernel_lock();
+    if (sem->count)
+    {
+        sem->count--;
+        neo_kernel_unlock();
+        return NEO_WAIT_OK;
+    }
+    if (!timeout)
+    {
+        neo_kernel_unlock();
+        return NEO_WAIT_TIMEOUT;
+    }
+
+    uint32_t status = neo_kernel_block_current(&sem->waiters, timeout);
+    neo_kernel_unlock();
+    return status;
+}
+
+/**
+ * @brief Kernel side of neo_sem_give and neo_sem_give_from_isr
+ * @return true if a waiter was woken or the count incremented; false at the limit or if the caller can't write the
+ * semaphore itself
+ */
+bool neo_sys_sem_give(neo_sem_t *sem)
+{
+    if (!neo_mpu_caller_can_write(sem, sizeof(*sem)))
+    {
+        return false;
+    }
+    bool given = true;
+
+    neo_kernel_lock();
+    if (neo_kernel_wake_one(&sem->waiters) == NEO_NO_THREAD)
+    {
+        if (sem->count < sem->limit)
+        {
+            sem->count++;
+        }
+        else
+        {
+            given = false;
+        }
+    }
+    neo_kernel_unlock();
+    return given;
+}
+
+/**
+ * @brief Take a semaphore, blocking for up to timeout milliseconds while its count is zero
+ * @param sem Pointer to semaphore structure
+ * @param timeout Milliseconds to wait; 0 only tries, NEO_WAIT_FOREVER waits as long as it takes
+ * @return true if the semaphore was taken, false on timeout
+ */
+bool neo_sem_take(neo_sem_t *sem, uint32_t timeout)
+{
+    if (!neo_kernel_in_thread())
+    {
+        timeout = 0; // only a thread can block
+    }
+
+    uint32_t status;
+    if (neo_in_privileged_context())
+    {
+        status = neo_sys_sem_take(sem, timeout);
+    }
+    else
+    {
+        status = neo_syscall(NEO_SYS_SEM_TAKE, (uint32_t)sem, timeout, 0, 0);
+    }
+    return neo_kernel_wait_outcome(status) == NEO_WAIT_OK;
+}
+
+/**
+ * @brief Give a semaphore, waking the highest-priority waiter if there is one
+ * @param sem Pointer to semaphore structure
+ * @return true if given, false if the count is already at its limit
+ */
+bool neo_sem_give(neo_sem_t *sem)
+{
+    if (neo_in_privileged_context())
+    {
+        return neo_sys_sem_give(sem);
+    }
+    return neo_syscall(NEO_SYS_SEM_GIVE, (uint32_t)sem, 0, 0, 0);
+}
+
+/**
+ * @brief Give a semaphore from an interrupt handler
+ * The woken thread runs as soon as the handler returns if it outranks the interrupted thread
+ * @param sem Pointer to semaphore structure
+ * @return true if given, false if the count is already at its limit
+ */
+bool neo_sem_give_from_isr(neo_sem_t *sem)
+{
+    return neo_sys_sem_give(sem);
+}
+
+static inline bool event_wait_satisfied(uint32_t flags, uint32_t bits, uint32_t options)
+{
+    return (options & NEO_EVENT_WAIT_ALL) ? (flags & bits) == bits : (flags & bits) != 0;
+}
+
+// returns the flags if they satisfy the wait right away, clearing the bits if asked to; 0 otherwise
+// must be called with the kernel locked
+static uint32_t event_group_try(neo_event_group_t *group, uint32_t bits, uint32_t options)
+{
+    uint32_t flags = group->flags;
+    if (!event_wait_satisfied(flags, bits, options))
+    {
+        return 0;
+    }
+    if (options & NEO_EVENT_CLEAR_ON_EXIT)
+    {
+        group->flags = flags & ~bits;
+    }
+    return flags;
+}
+
+/**
+ * @brief Initialize an event group with all flags clear; same as assigning NEO_EVENT_GROUP_INIT
+ * @param group Pointer to event group structure
+ */
+void neo_event_group_init(neo_event_group_t *group)
+{
+    group->flags = 0;
+    group->waiters.summary = 0;
+    for (uint32_t leaf = 0; leaf < NEO_BITMAP_LEAVES; leaf++)
+    {
+        group->waiters.leaf[leaf] = 0;
+    }
+}
+
+/**
+ * @brief Kernel side of neo_event_group_wait; the flags that satisfied the wait are left in the caller's wait data
+ * @return NEO_WAIT_OK if the flags satisfy the wait, NEO_WAIT_TIMEOUT if they don't and timeout is zero,
+ * NEO_WAIT_PENDING if the caller was blocked; NEO_WAIT_TIMEOUT as well if the caller can't write the group itself
+ */
+uint32_t neo_sys_event_group_wait(neo_event_group_t *group, uint32_t bits, uint32_t options, uint32_t timeout)
+{
+    if (!neo_mpu_caller_can_write(group, sizeof(*group)))
+    {
+        return NEO_WAIT_TIMEOUT;
+    }
+    uint32_t self_index = neo_kernel_current_thread();
+
+    neo_kernel_lock();
+    uint32_t flags = event_group_try(group, bits, options);
+    if (flags)
+    {
+        wait_data[self_index] = (void *)flags;
+        neo_kernel_unlock();
+        return NEO_WAIT_OK;
+    }
+    if (!timeout)
+    {
+        neo_kernel_unlock();
+        return NEO_WAIT_TIMEOUT;
+    }
+
+    event_wait_bits[self_index] = bits;
+    event_wait_options[self_index] = (uint8_t)options;
+    neo_bitmap_set(&group->waiters, self_index);
+    uint32_t status = neo_kernel_block_current_on(group, timeout);
+    neo_kernel_unlock();
+    return status;
+}
+
+/**
+ * @brief Kernel side of neo_event_group_set and neo_event_group_set_from_isr
+ * One pass over the waiter bitmap, with RBIT + CLZ per waiter; a waiter whose wait timed out is dropped on the way
+ * The waiter bitmap is in the group, which unprivileged threads can write, so only its real words are read and only the
+ * ids of threads the kernel has blocked on the group are acted on
+ * @return The flags once the bits are set and the satisfied waiters' clears are applied; 0 if the caller can't write
+ * the group itself
+ */
+uint32_t neo_sys_event_group_set(neo_event_group_t *group, uint32_t bits)
+{
+    if (!neo_mpu_caller_can_write(group, sizeof(*group)))
+    {
+        return 0;
+    }
+
+    neo_kernel_lock();
+    uint32_t flags = group->flags | bits;
+    uint32_t clear_bits = 0;
+
+    for (uint32_t words = group->waiters.summary & ((2U << (NEO_BITMAP_LEAVES - 1U)) - 1U); words; words &= words - 1U)
+    {
+        uint32_t word = neo_least_sig_one(words);
+        for (uint32_t leaf = group->waiters.leaf[word]; leaf; leaf &= leaf - 1U)
+        {
+            uint32_t index = word * 32U + neo_least_sig_one(leaf);
+            if (index >= MAX_THREADS || !neo_kernel_is_waiting_for(index, group))
+            {
+                neo_bitmap_clear(&group->waiters, index); // timed out since it was added
+                continue;
+            }
+            if (!event_wait_satisfied(flags, event_wait_bits[index], event_wait_options[index]))
+            {
+                continue;
+            }
+
+            if (event_wait_options[index] & NEO_EVENT_CLEAR_ON_EXIT)
+            {
+                clear_bits |= event_wait_bits[index];
+            }
+            wait_data[index] = (void *)flags;
+            neo_bitmap_clear(&group->waiters, index);
+            neo_kernel_wake(index);
+        }
+    }
+
+    group->flags = flags & ~clear_bits;
+    flags = group->flags;
+    neo_kernel_unlock();
+    return flags;
+}
+
+/**
+ * @brief Kernel side of neo_event_group_clear
+ * @return The flags before clearing; 0 if the caller can't write the group itself
+ */
+uint32_t neo_sys_event_group_clear(neo_event_group_t *group, uint32_t bits)
+{
+    if (!neo_mpu_caller_can_write(group, sizeof(*group)))
+    {
+        return 0;
+    }
+
+    neo_kernel_lock();
+    uint32_t flags = group->flags;
+    group->flags = flags & ~bits;
+    neo_kernel_unlock();
+    return flags;
+}
+
+/**
+ * @brief Wait until any or all of the given bits are set, for up to timeout milliseconds
+ * @param group Pointer to event group structure
+ * @param bits Bits to wait for; must not be zero
+ * @param options NEO_EVENT_WAIT_ALL and/or NEO_EVENT_CLEAR_ON_EXIT, or 0 to wait for any bit and leave the flags alone
+ * @param timeout Milliseconds to wait; 0 only checks, NEO_WAIT_FOREVER waits as long as it takes
+ * @return The flags that satisfied the wait (before any clearing), or 0 on timeout
+ */
+uint32_t neo_event_group_wait(neo_event_group_t *group, uint32_t bits, uint32_t options, uint32_t timeout)
+{
+    if (!bits)
+    {
+        return 0;
+    }
+
+    if (!neo_kernel_in_thread())
+    {
+        // only a thread can block, and only a thread has wait data
+        neo_kernel_lock();
+        uint32_t flags = event_group_try(group, bits, options);
+        neo_kernel_unlock();
+        return flags;
+    }
+
+    uint32_t status;
+    if (neo_in_privileged_context())
+    {
+        status = neo_sys_event_group_wait(group, bits, options, timeout);
+    }
+    else
+    {
+        status = neo_syscall(NEO_SYS_EVENT_GROUP_WAIT, (uint32_t)group, bits, options, timeout);
+    }
+    return neo_kernel_wait_outcome(status) == NEO_WAIT_OK ? (uint32_t)neo_kernel_wait_data() : 0;
+}
+
+/**
+ * @brief Set bits and wake every waiter they satisfy
+ * @param group Pointer to event group structure
+ * @param bits Bits to set
+ * @return The flags once the bits are set and the woken waiters' clears are applied
+ */
+uint32_t neo_event_group_set(neo_event_group_t *group, uint32_t bits)
+{
+    if (neo_in_privileged_context())
+    {
+        return neo_sys_event_group_set(group, bits);
+    }
+    return neo_syscall(NEO_SYS_EVENT_GROUP_SET, (uint32_t)group, bits, 0, 0);
+}
+
+/**
+ * @brief Set bits from an interrupt handler
+ * Woken threads run as soon as the handler returns if they outrank the interrupted thread
+ * @param group Pointer to event group structure
+ * @param bits Bits to set
+ * @return The flags once the bits are set and the woken waiters' clears are applied
+ */
+uint32_t neo_event_group_set_from_isr(neo_event_group_t *group, uint32_t bits)
+{
+    return neo_sys_event_group_set(group, bits);
+}
+
+/**
+ * @brief Clear bits
+ * @param group Pointer to event group structure
+ * @param bits Bits to clear
+ * @return The flags before clearing
+ */
+uint32_t neo_event_group_clear(neo_event_group_t *group, uint32_t bits)
+{
+    if (neo_in_privileged_context())
+    {
+        return neo_sys_event_group_clear(group, bits);
+    }
+    return neo_syscall(NEO_SYS_EVENT_GROUP_CLEAR, (uint32_t)group, bits, 0, 0);
+}
+
+/**
+ * @brief Read the flags without changing them
+ * @param group Pointer to event group structure
+ * @return The current flags
+ */
+uint32_t neo_event_group_get(neo_event_group_t *group)
+{
+    return group->flags;
+}